@@ -0,0 +1,154 @@
+#include "emit_cpp.h"
+#include "interpreter.h"
+
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <fstream>
+#include <sstream>
+#include <string>
+#include <unistd.h>
+#include <utility>
+#include <vector>
+
+#ifndef DL_CXX_COMPILER
+#define DL_CXX_COMPILER "g++"
+#endif
+
+// used when no programs are named on the command line
+static const std::vector<std::pair<std::string, std::string>> workloads = {
+    {"fib 27",
+     "(let fib = (function n (if (val 2) (var n) then (var n) "
+     "else (add (call (var fib) (add (var n) (val -1))) "
+     "(call (var fib) (add (var n) (val -2)))))) in "
+     "(call (var fib) (val 27)))"},
+    {"counter closure 100x1e4",
+     "(let total = (val 0) in "
+     "(let bump = (function k (set total (add (var total) (var k)))) in "
+     "(let inner = (function n (if (var n) (val 0) "
+     "then (block (call (var bump) (var n)) "
+     "(call (var inner) (add (var n) (val -1)))) "
+     "else (var total))) in "
+     "(let outer = (function m (if (var m) (val 0) "
+     "then (block (call (var inner) (val 10000)) "
+     "(call (var outer) (add (var m) (val -1)))) "
+     "else (var total))) in "
+     "(call (var outer) (val 100))))))"},
+};
+
+static double seconds_since(std::chrono::steady_clock::time_point start) {
+    std::chrono::duration<double> elapsed =
+            std::chrono::steady_clock::now() - start;
+    return elapsed.count();
+}
+
+static std::string interpret(const std::string &source) {
+    try {
+        Interpreter interpreter;
+        return interpreter.evaluate(interpreter.prepare(source))->to_string();
+    } catch (std::exception& Exception) {
+        return std::string("ERROR: ") + Exception.what();
+    }
+}
+
+static std::string run_command(const std::string &command) {
+    std::string output;
+    FILE *pipe = popen(command.c_str(), "r");
+
+    if (pipe == nullptr) {
+        return output;
+    }
+
+    char chunk[4096];
+    size_t n;
+
+    while ((n = fread(chunk, 1, sizeof chunk, pipe)) > 0) {
+        output.append(chunk, n);
+    }
+
+    pclose(pipe);
+
+    // the generated main() ends its output with a newline
+    if (!output.empty() && output.back() == '\n') {
+        output.pop_back();
+    }
+
+    return output;
+}
+
+/**
+ * Runs each program through the interpreter and through --emit-cpp and
+ * DL_CXX_COMPILER, checks that both print the same, and reports the time
+ * of each. The AOT run time includes starting the process.
+ */
+int main(int argc, char* argv[]) {
+    std::vector<std::pair<std::string, std::string>> programs;
+
+    for (int i = 1; i < argc; i++) {
+        std::ifstream file(argv[i]);
+        std::stringstream text;
+        text << file.rdbuf();
+        programs.emplace_back(argv[i], text.str());
+    }
+
+    if (programs.empty()) {
+        programs = workloads;
+    }
+
+    char directory[] = "/tmp/dl_aot_XXXXXX";
+
+    if (mkdtemp(directory) == nullptr) {
+        std::perror("mkdtemp");
+        return 1;
+    }
+
+    std::string source_path = std::string(directory) + "/program.cpp";
+    std::string binary_path = std::string(directory) + "/program";
+    int mismatches = 0;
+
+    std::printf("%-32s %12s %12s %12s\n", "program", "interpreted",
+                "aot compile", "aot run");
+
+    for (const auto& [name, source] : programs) {
+        auto start = std::chrono::steady_clock::now();
+        std::string expected = interpret(source);
+        double interpreted = seconds_since(start);
+
+        try {
+            Interpreter interpreter;
+            interpreter.getPatterns().clear();
+            std::ofstream(source_path) << emit_cpp(
+                    *interpreter.prepare(source)->getRoot());
+        } catch (std::exception& Exception) {
+            std::fprintf(stderr, "%s: %s\n", name.c_str(), Exception.what());
+            mismatches++;
+            continue;
+        }
+
+        start = std::chrono::steady_clock::now();
+        std::string compile = std::string(DL_CXX_COMPILER) +
+                " -std=c++17 -O3 -o " + binary_path + " " + source_path;
+
+        if (std::system(compile.c_str()) != 0) {
+            std::fprintf(stderr, "%s: compilation failed\n", name.c_str());
+            mismatches++;
+            continue;
+        }
+
+        double compiled = seconds_since(start);
+
+        start = std::chrono::steady_clock::now();
+        std::string result = run_command(binary_path);
+        double ran = seconds_since(start);
+
+        mismatches += result != expected;
+        std::printf("%-32s %10.2f ms %10.2f ms %10.2f ms%s\n", name.c_str(),
+                    interpreted * 1e3, compiled * 1e3, ran * 1e3,
+                    result == expected ? "" : "  MISMATCH");
+    }
+
+    unlink(source_path.c_str());
+    unlink(binary_path.c_str());
+    rmdir(directory);
+    return mismatches == 0 ? 0 : 1;
+}
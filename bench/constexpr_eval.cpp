@@ -0,0 +1,73 @@
+#include "constexpr_dl.h"
+#include "dl_examples.h"
+#include "interpreter.h"
+
+#include <chrono>
+#include <cstdio>
+#include <fstream>
+#include <iterator>
+#include <sstream>
+#include <string>
+#include <utility>
+
+/**
+ * examples/<name>.dl evaluated by the compiler, against examples/<name>.out;
+ * a mismatch names dl_examples[I] in the instantiation that fails.
+ */
+template <size_t I>
+struct ExampleMatches {
+    static_assert(constexpr_eval(dl_examples[I].source) ==
+                  dl_examples[I].expected,
+                  "constexpr_eval() disagrees with the example's .out file");
+    static constexpr bool value = true;
+};
+
+template <size_t... I>
+constexpr bool examples_match(std::index_sequence<I...>) {
+    return (ExampleMatches<I>::value && ...);
+}
+
+static_assert(examples_match(
+        std::make_index_sequence<std::size(dl_examples)>()));
+
+static_assert(constexpr_eval(
+        "(let fib = (function n (if (val 2) (var n) then (var n) "
+        "else (add (call (var fib) (add (var n) (val -1))) "
+        "(call (var fib) (add (var n) (val -2)))))) in "
+        "(call (var fib) (val 10)))") == 55);
+
+/**
+ * Compares constexpr_eval() with the interpreter on the programs named on
+ * the command line, and reports what the interpreter takes for each.
+ */
+int main(int argc, char* argv[]) {
+    Interpreter interpreter;
+    int mismatches = 0;
+
+    for (int i = 1; i < argc; i++) {
+        std::ifstream file(argv[i]);
+        std::stringstream text;
+        text << file.rdbuf();
+        std::string source = text.str();
+
+        try {
+            auto start = std::chrono::steady_clock::now();
+            int expected = interpreter.evaluate(interpreter.prepare(source))
+                    ->get_value();
+            std::chrono::duration<double, std::micro> elapsed =
+                    std::chrono::steady_clock::now() - start;
+
+            int result = constexpr_eval(source);
+            mismatches += result != expected;
+
+            std::printf("%-32s %8d %8d %10.2f us%s\n", argv[i], expected,
+                        result, elapsed.count(),
+                        result == expected ? "" : "  MISMATCH");
+        } catch (std::exception& Exception) {
+            std::fprintf(stderr, "%s: %s\n", argv[i], Exception.what());
+            mismatches++;
+        }
+    }
+
+    return mismatches == 0 ? 0 : 1;
+}
@@ -0,0 +1,45 @@
+#include "interpreter.h"
+
+#include <chrono>
+#include <cstdio>
+#include <string>
+
+static const std::string source =
+        "(let inc = (function n (add (var n) (val 1))) in "
+        "(if (var x) (val 0) then (call (var inc) (var x)) else (val 0)))";
+
+template <typename F>
+static double nanoseconds_per_run(long runs, F run) {
+    auto start = std::chrono::steady_clock::now();
+
+    for (long i = 0; i < runs; i++) {
+        run(i);
+    }
+
+    std::chrono::duration<double, std::nano> elapsed =
+            std::chrono::steady_clock::now() - start;
+    return elapsed.count() / runs;
+}
+
+int main(int argc, char* argv[]) {
+    long runs = argc > 1 ? std::stol(argv[1]) : 1000000;
+    Interpreter interpreter;
+    long checksum = 0;
+
+    double reparsed = nanoseconds_per_run(runs, [&](long i) {
+        std::string program = "(let x = (val " + std::to_string(i) +
+                ") in " + source + ")";
+        checksum += interpreter.evaluate(interpreter.prepare(program))
+                ->get_value();
+    });
+
+    ProgramHandle prepared = interpreter.prepare(source);
+    double bound = nanoseconds_per_run(runs, [&](long i) {
+        checksum -= interpreter.evaluate(prepared, {{"x", int(i)}})
+                ->get_value();
+    });
+
+    std::printf("%-28s %10.1f ns\n", "prepare + evaluate", reparsed);
+    std::printf("%-28s %10.1f ns\n", "evaluate prepared, bound x", bound);
+    return checksum == 0 ? 0 : 1;
+}
@@ -0,0 +1,48 @@
+#include "parser.h"
+
+#include <chrono>
+#include <cstdio>
+#include <sstream>
+#include <string>
+
+/**
+ * Builds a program of roughly 'size' bytes: a right-leaning chain of
+ * 'let' and 'add' forms nested as deep as the size allows.
+ */
+static std::string generate(size_t size) {
+    static const std::string let_head = "(let x = (val 1) in ";
+    static const std::string add_head = "(add (var x) ";
+    static const std::string leaf = "(val 7)";
+
+    std::string head;
+    size_t levels = 0;
+
+    while (head.size() + leaf.size() + 2 * levels < size) {
+        head += levels % 2 == 0 ? let_head : add_head;
+        levels++;
+    }
+
+    return head + leaf + std::string(levels, ')');
+}
+
+int main(int argc, char* argv[]) {
+    // 1 GB inputs need tens of GB for the tree, so the default stops at 64 MB
+    size_t max_size = argc > 1 ? std::stoull(argv[1]) : (size_t(64) << 20);
+
+    std::printf("%12s %12s %10s\n", "bytes", "seconds", "MB/s");
+
+    for (size_t size = 1024; size <= max_size; size *= 4) {
+        std::istringstream input(generate(size));
+        Parser parser;
+
+        auto start = std::chrono::steady_clock::now();
+        std::shared_ptr<Expression> expr = parser.read_and_create(input);
+        std::chrono::duration<double> elapsed =
+                std::chrono::steady_clock::now() - start;
+
+        std::printf("%12zu %12.6f %10.2f\n", size, elapsed.count(),
+                    size / elapsed.count() / (1 << 20));
+    }
+
+    return 0;
+}
@@ -0,0 +1,76 @@
+#include "accounting.h"
+#include "errors.h"
+
+#include <new>
+
+thread_local MemoryAccounting *MemoryAccounting::current = nullptr;
+
+MemoryAccounting::MemoryAccounting() :
+    references(1),
+    limit(0)
+{}
+
+std::unique_ptr<MemoryAccounting, MemoryAccounting::Disown>
+        MemoryAccounting::create() {
+    return std::unique_ptr<MemoryAccounting, Disown>(new MemoryAccounting());
+}
+
+void MemoryAccounting::release() {
+    if (references.fetch_sub(1, std::memory_order_acq_rel) == 1) {
+        delete this;
+    }
+}
+
+void* MemoryAccounting::allocate(memoryCategory category, size_t bytes) {
+    if (category != ast_nodes && limit != 0 &&
+        counters[runtime_values].live_bytes.load(std::memory_order_relaxed) +
+        counters[env_storage].live_bytes.load(std::memory_order_relaxed) +
+        bytes > limit) {
+        throw memory_error();
+    }
+
+    void *pointer = ::operator new(bytes);
+    Counters &counter = counters[category];
+    size_t live = counter.live_bytes.fetch_add(bytes,
+            std::memory_order_relaxed) + bytes;
+    size_t peak = counter.peak_bytes.load(std::memory_order_relaxed);
+
+    while (live > peak && !counter.peak_bytes.compare_exchange_weak(peak,
+            live, std::memory_order_relaxed)) {}
+
+    counter.live_count.fetch_add(1, std::memory_order_relaxed);
+    counter.allocations.fetch_add(1, std::memory_order_relaxed);
+    references.fetch_add(1, std::memory_order_relaxed);
+    return pointer;
+}
+
+void MemoryAccounting::deallocate(memoryCategory category, void *pointer,
+                                  size_t bytes) {
+    ::operator delete(pointer);
+    counters[category].live_bytes.fetch_sub(bytes, std::memory_order_relaxed);
+    counters[category].live_count.fetch_sub(1, std::memory_order_relaxed);
+    release();
+}
+
+void MemoryAccounting::setBudget(size_t bytes) {
+    limit = bytes == 0 ? 0 :
+            counters[runtime_values].live_bytes.load() +
+            counters[env_storage].live_bytes.load() + bytes;
+}
+
+MemoryStats MemoryAccounting::getStats(memoryCategory category) const {
+    const Counters &counter = counters[category];
+    return {counter.live_bytes.load(), counter.peak_bytes.load(),
+            counter.live_count.load(), counter.allocations.load()};
+}
+
+const char* MemoryAccounting::category_name(memoryCategory category) {
+    switch (category) {
+        case ast_nodes:
+            return "ast_nodes";
+        case runtime_values:
+            return "runtime_values";
+        default:
+            return "env_storage";
+    }
+}
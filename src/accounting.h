@@ -0,0 +1,181 @@
+#ifndef __ACCOUNTING_H__
+#define __ACCOUNTING_H__
+
+#include <atomic>
+#include <cstddef>
+#include <memory>
+#include <type_traits>
+#include <utility>
+
+enum memoryCategory {ast_nodes = 0, runtime_values = 1, env_storage = 2};
+
+constexpr size_t memory_categories = 3;
+
+struct MemoryStats {
+    size_t live_bytes;
+    size_t peak_bytes;
+    size_t live_count;
+    size_t allocations;
+};
+
+/**
+ * Allocation counters of one Interpreter, by category. Every counted
+ * allocation keeps its accounting alive, so memory released after the
+ * Interpreter is gone, e.g. a cached Program, is still subtracted from
+ * the right counters. Counters are atomic: a Program may be freed on a
+ * thread other than the one that parsed it.
+ */
+class MemoryAccounting {
+    struct Counters {
+        std::atomic<size_t> live_bytes{0};
+        std::atomic<size_t> peak_bytes{0};
+        std::atomic<size_t> live_count{0};
+        std::atomic<size_t> allocations{0};
+    };
+
+    Counters counters[memory_categories];
+    // the owner plus one per live allocation
+    std::atomic<size_t> references;
+    // bound on runtime values and env storage together, 0 for none
+    size_t limit;
+
+    MemoryAccounting();
+
+    void release();
+
+public:
+
+    /**
+     * Accounting that allocators constructed on this thread count into,
+     * nullptr when nothing is counted.
+     */
+    static thread_local MemoryAccounting *current;
+
+    /**
+     * Makes 'accounting' the current one until the end of the scope.
+     */
+    class Scope {
+        MemoryAccounting *previous;
+    public:
+
+        explicit Scope(MemoryAccounting *accounting) :
+            previous(current)
+        {
+            current = accounting;
+        }
+
+        ~Scope() {
+            current = previous;
+        }
+
+        Scope(const Scope&) = delete;
+
+        Scope& operator=(const Scope&) = delete;
+    };
+
+    // deleter for the owner's handle
+    struct Disown {
+        void operator()(MemoryAccounting *accounting) const {
+            accounting->release();
+        }
+    };
+
+    static std::unique_ptr<MemoryAccounting, Disown> create();
+
+    /**
+     * @throws memory_error if the allocation would take runtime values and
+     *         env storage past the limit
+     */
+    void* allocate(memoryCategory category, size_t bytes);
+
+    void deallocate(memoryCategory category, void *pointer, size_t bytes);
+
+    /**
+     * Limits runtime values and env storage to 'bytes' more than they
+     * take now; 0 removes the limit.
+     */
+    void setBudget(size_t bytes);
+
+    MemoryStats getStats(memoryCategory category) const;
+
+    static const char* category_name(memoryCategory category);
+};
+
+/**
+ * Standard allocator that counts into the accounting current when it was
+ * constructed, or allocates plainly if there was none. Copies, including
+ * the one a shared_ptr control block keeps, count into the same one.
+ */
+template <class T, memoryCategory Category>
+class CountingAllocator {
+public:
+    using value_type = T;
+    using propagate_on_container_copy_assignment = std::true_type;
+    using propagate_on_container_move_assignment = std::true_type;
+    using propagate_on_container_swap = std::true_type;
+
+    template <class U>
+    struct rebind {
+        using other = CountingAllocator<U, Category>;
+    };
+
+    MemoryAccounting *accounting;
+
+    CountingAllocator() noexcept :
+        accounting(MemoryAccounting::current)
+    {}
+
+    template <class U>
+    CountingAllocator(const CountingAllocator<U, Category> &that) noexcept :
+        accounting(that.accounting)
+    {}
+
+    // a copied container counts where it was copied, not where it came from
+    CountingAllocator select_on_container_copy_construction() const {
+        return CountingAllocator();
+    }
+
+    T* allocate(size_t n) {
+        if (accounting == nullptr) {
+            return std::allocator<T>().allocate(n);
+        }
+
+        return static_cast<T*>(accounting->allocate(Category, n * sizeof(T)));
+    }
+
+    void deallocate(T *pointer, size_t n) {
+        if (accounting == nullptr) {
+            std::allocator<T>().deallocate(pointer, n);
+        }
+        else {
+            accounting->deallocate(Category, pointer, n * sizeof(T));
+        }
+    }
+
+    template <class U>
+    bool operator==(const CountingAllocator<U, Category> &that) const {
+        return accounting == that.accounting;
+    }
+
+    template <class U>
+    bool operator!=(const CountingAllocator<U, Category> &that) const {
+        return accounting != that.accounting;
+    }
+};
+
+/**
+ * std::make_shared, counting the object and its control block if there
+ * is a current accounting.
+ */
+template <class T, memoryCategory Category, class... Args>
+std::shared_ptr<T> make_counted(Args&&... args) {
+    // a plain control block, without an allocator to keep
+    if (MemoryAccounting::current == nullptr) {
+        return std::make_shared<T>(std::forward<Args>(args)...);
+    }
+
+    return std::allocate_shared<T>(CountingAllocator<T, Category>(),
+                                   std::forward<Args>(args)...);
+}
+
+#endif // __ACCOUNTING_H__
@@ -0,0 +1,527 @@
+#ifndef __CONSTEXPR_DL_H__
+#define __CONSTEXPR_DL_H__
+
+#include <cstddef>
+#include <stdexcept>
+#include <string_view>
+#include "errors.h"
+#include "expressions.h"
+
+/**
+ * Header-only DL parser and evaluator usable in constant expressions:
+ *
+ *     constexpr int n = constexpr_eval("(add (val 40) (val 2))");
+ *
+ * Follows the same grammar and semantics as Parser and Expression::eval,
+ * but keeps everything in fixed-capacity arrays instead of the heap, so
+ * it only takes programs that fit the template capacities. Any error
+ * makes the call non-constant, i.e. a compile error in a constexpr
+ * context; at run time the same exceptions as the interpreter's are
+ * thrown.
+ */
+template <size_t MaxNodes = 512, size_t MaxBoxes = 1024,
+          size_t MaxScope = 64, size_t MaxCaptured = 4096>
+class ConstexprInterpreter {
+
+    static constexpr int block_end = -1;
+    static constexpr int end_of_input = -2;
+    static constexpr int none = -1;
+
+    // children are linked through 'next', in source order
+    struct Node {
+        typeInHash type = val;
+        int integer = 0;
+        std::string_view id;
+        int first = none;
+        int last = none;
+        int next = none;
+    };
+
+    struct Value {
+        enum {integer, function, other} kind = other;
+        int number = 0;
+        int closure = none;
+    };
+
+    struct Binding {
+        std::string_view name;
+        int box = none;
+    };
+
+    // variables visible in one function activation, like Env::currentEnv
+    struct Scope {
+        Binding bindings[MaxScope] = {};
+        size_t count = 0;
+    };
+
+    // function node with a copy of the bindings it was created under
+    struct Closure {
+        int function = none;
+        size_t first = 0;
+        size_t count = 0;
+    };
+
+    std::string_view source;
+    size_t pos = 0;
+    int depth = 0;
+    int block_depths[MaxNodes] = {};
+    size_t blocks = 0;
+
+    Node nodes[MaxNodes] = {};
+    size_t node_count = 0;
+    Value boxes[MaxBoxes] = {};
+    size_t box_count = 0;
+    Binding captured[MaxCaptured] = {};
+    size_t captured_count = 0;
+    Closure closures[MaxBoxes] = {};
+    size_t closure_count = 0;
+
+    ////////////// Parsing /////////////////
+
+    static constexpr bool is_space(char c) {
+        return c == ' ' || c == '\t' || c == '\n' || c == '\v' ||
+               c == '\f' || c == '\r';
+    }
+
+    // returns "(", ")", a word, or an empty view at the end of input
+    constexpr std::string_view next_token() {
+        while (pos < source.size() && is_space(source[pos])) {
+            pos++;
+        }
+
+        if (pos == source.size()) {
+            return {};
+        }
+
+        size_t start = pos++;
+
+        if (source[start] == '(' || source[start] == ')') {
+            return source.substr(start, 1);
+        }
+
+        while (pos < source.size() && !is_space(source[pos]) &&
+               source[pos] != '(' && source[pos] != ')') {
+            pos++;
+        }
+
+        return source.substr(start, pos - start);
+    }
+
+    constexpr std::string_view read_word() {
+        std::string_view token = next_token();
+
+        while (token == "(") {
+            depth++;
+            token = next_token();
+        }
+
+        if (token.empty() || token == ")") {
+            throw parse_error();
+        }
+
+        return token;
+    }
+
+    constexpr void expect_word(std::string_view expected) {
+        std::string_view token = next_token();
+
+        while (token == "(" || token == ")") {
+            depth += token == "(" ? 1 : -1;
+
+            if (blocks > 0 && depth < block_depths[blocks - 1]) {
+                throw parse_error();
+            }
+
+            token = next_token();
+        }
+
+        if (token != expected) {
+            throw parse_error();
+        }
+    }
+
+    static constexpr int to_integer(std::string_view word) {
+        size_t i = 0;
+        bool negative = false;
+        long long result = 0;
+
+        if (i < word.size() && (word[i] == '-' || word[i] == '+')) {
+            negative = word[i++] == '-';
+        }
+
+        if (i == word.size() || word[i] < '0' || word[i] > '9') {
+            throw std::invalid_argument("stoi");
+        }
+
+        for (; i < word.size() && word[i] >= '0' && word[i] <= '9'; i++) {
+            result = result * 10 + (word[i] - '0');
+
+            if (result > 2147483648ll) {
+                throw std::out_of_range("stoi");
+            }
+        }
+
+        result = negative ? -result : result;
+
+        if (result > 2147483647ll) {
+            throw std::out_of_range("stoi");
+        }
+
+        return static_cast<int>(result);
+    }
+
+    constexpr int new_node(typeInHash type) {
+        if (node_count == MaxNodes) {
+            throw parse_error();
+        }
+
+        nodes[node_count].type = type;
+        return static_cast<int>(node_count++);
+    }
+
+    constexpr void add_child(int parent, int child) {
+        if (nodes[parent].first == none) {
+            nodes[parent].first = child;
+        }
+        else {
+            nodes[nodes[parent].last].next = child;
+        }
+
+        nodes[parent].last = child;
+    }
+
+    constexpr int child(int node, int index) const {
+        int result = nodes[node].first;
+
+        while (index-- > 0) {
+            result = nodes[result].next;
+        }
+
+        return result;
+    }
+
+    constexpr int expect_expression() {
+        int result = parse_expression();
+
+        if (result < 0) {
+            throw parse_error();
+        }
+
+        return result;
+    }
+
+    constexpr void read_operands(int node, int count) {
+        for (int i = 0; i < count; i++) {
+            add_child(node, expect_expression());
+        }
+    }
+
+    /**
+     * Same rules as Parser::read_and_create: parentheses only matter for
+     * finding where a 'block' ends.
+     */
+    constexpr int parse_expression() {
+        while (true) {
+            std::string_view token = next_token();
+
+            if (token.empty()) {
+                return end_of_input;
+            }
+
+            if (token == "(") {
+                depth++;
+                continue;
+            }
+
+            if (token == ")") {
+                depth--;
+
+                if (blocks > 0 && depth < block_depths[blocks - 1]) {
+                    return block_end;
+                }
+                continue;
+            }
+
+            int node = none;
+
+            if (token == "val") {
+                node = new_node(val);
+                nodes[node].integer = to_integer(read_word());
+            }
+            else if (token == "var") {
+                node = new_node(var);
+                nodes[node].id = read_word();
+            }
+            else if (token == "add") {
+                node = new_node(add);
+                read_operands(node, 2);
+            }
+            else if (token == "if") {
+                node = new_node(_if);
+                read_operands(node, 2);
+                expect_word("then");
+                read_operands(node, 1);
+                expect_word("else");
+                read_operands(node, 1);
+            }
+            else if (token == "let") {
+                node = new_node(let);
+                nodes[node].id = read_word();
+                expect_word("=");
+                read_operands(node, 1);
+                expect_word("in");
+                read_operands(node, 1);
+            }
+            else if (token == "function") {
+                node = new_node(function);
+                nodes[node].id = read_word();
+                read_operands(node, 1);
+            }
+            else if (token == "call") {
+                node = new_node(call);
+                read_operands(node, 2);
+            }
+            else if (token == "set") {
+                node = new_node(set);
+                nodes[node].id = read_word();
+                read_operands(node, 1);
+            }
+            else if (token == "block") {
+                node = new_node(block);
+                block_depths[blocks++] = depth;
+                int operand = none;
+
+                while ((operand = parse_expression()) >= 0) {
+                    add_child(node, operand);
+                }
+
+                blocks--;
+
+                if (nodes[node].first == none) {
+                    throw parse_error();
+                }
+            }
+            else {
+                throw parse_error();
+            }
+
+            return node;
+        }
+    }
+
+    ////////////// Evaluation /////////////////
+
+    constexpr int new_box(Value value) {
+        if (box_count == MaxBoxes) {
+            throw eval_error();
+        }
+
+        boxes[box_count] = value;
+        return static_cast<int>(box_count++);
+    }
+
+    static constexpr int find(const Scope &scope, std::string_view name) {
+        for (size_t i = 0; i < scope.count; i++) {
+            if (scope.bindings[i].name == name) {
+                return static_cast<int>(i);
+            }
+        }
+
+        return none;
+    }
+
+    // binds 'name' to 'box' and returns the box it shadows, or none
+    static constexpr int bind(Scope &scope, std::string_view name, int box) {
+        int found = find(scope, name);
+
+        if (found != none) {
+            int shadowed = scope.bindings[found].box;
+            scope.bindings[found].box = box;
+            return shadowed;
+        }
+
+        if (scope.count == MaxScope) {
+            throw eval_error();
+        }
+
+        scope.bindings[scope.count++] = {name, box};
+        return none;
+    }
+
+    static constexpr void restore(Scope &scope, std::string_view name,
+                                  int shadowed) {
+        int found = find(scope, name);
+
+        if (shadowed != none) {
+            scope.bindings[found].box = shadowed;
+        }
+        else {
+            scope.bindings[found] = scope.bindings[--scope.count];
+        }
+    }
+
+    static constexpr int as_integer(Value value) {
+        if (value.kind != Value::integer) {
+            throw getValue_error();
+        }
+
+        return value.number;
+    }
+
+    constexpr Value make_closure(int function, const Scope &scope) {
+        if (closure_count == MaxBoxes ||
+            captured_count + scope.count > MaxCaptured) {
+            throw eval_error();
+        }
+
+        closures[closure_count] = {function, captured_count, scope.count};
+
+        for (size_t i = 0; i < scope.count; i++) {
+            captured[captured_count++] = scope.bindings[i];
+        }
+
+        Value result;
+        result.kind = Value::function;
+        result.closure = static_cast<int>(closure_count++);
+        return result;
+    }
+
+    constexpr Value apply(Value callee, Value argument) {
+        if (callee.kind != Value::function) {
+            throw eval_error();
+        }
+
+        const Closure &closure = closures[callee.closure];
+        Scope scope;
+
+        for (size_t i = 0; i < closure.count; i++) {
+            scope.bindings[scope.count++] = captured[closure.first + i];
+        }
+
+        bind(scope, nodes[closure.function].id, new_box(argument));
+        return eval(child(closure.function, 0), scope);
+    }
+
+    constexpr Value eval(int node, Scope &scope) {
+        const Node &current = nodes[node];
+
+        switch (current.type) {
+            case val: {
+                Value result;
+                result.kind = Value::integer;
+                result.number = current.integer;
+                return result;
+            }
+            case var: {
+                int found = find(scope, current.id);
+
+                if (found == none) {
+                    throw std::out_of_range("unordered_map::at");
+                }
+
+                return boxes[scope.bindings[found].box];
+            }
+            case add: {
+                Value result;
+                result.kind = Value::integer;
+                result.number = as_integer(eval(child(node, 0), scope)) +
+                                as_integer(eval(child(node, 1), scope));
+                return result;
+            }
+            case _if: {
+                if (as_integer(eval(child(node, 0), scope)) >
+                    as_integer(eval(child(node, 1), scope))) {
+                    return eval(child(node, 2), scope);
+                }
+
+                return eval(child(node, 3), scope);
+            }
+            case let: {
+                int value_node = child(node, 0);
+                int box = none;
+                int shadowed = none;
+
+                // as in Let::eval, a function may refer to its own name
+                if (nodes[value_node].type == function) {
+                    box = new_box(Value());
+                    shadowed = bind(scope, current.id, box);
+                    boxes[box] = eval(value_node, scope);
+                }
+                else {
+                    box = new_box(eval(value_node, scope));
+                    shadowed = bind(scope, current.id, box);
+                }
+
+                Value result = eval(child(node, 1), scope);
+                restore(scope, current.id, shadowed);
+                return result;
+            }
+            case function:
+                return make_closure(node, scope);
+            case call: {
+                Value callee = eval(child(node, 0), scope);
+                Value argument = eval(child(node, 1), scope);
+                return apply(callee, argument);
+            }
+            case set: {
+                Value value = eval(child(node, 0), scope);
+                int found = find(scope, current.id);
+
+                if (found != none) {
+                    boxes[scope.bindings[found].box] = value;
+                }
+                else {
+                    bind(scope, current.id, new_box(value));
+                }
+
+                return Value();
+            }
+            case block: {
+                Value result;
+
+                for (int i = current.first; i != none; i = nodes[i].next) {
+                    result = eval(i, scope);
+                }
+
+                return result;
+            }
+            default:
+                throw eval_error();
+        }
+    }
+
+public:
+
+    /**
+     * Parses and evaluates 'program'.
+     *
+     * @return the value of the program
+     *
+     * @throws parse_error, eval_error or getValue_error as the runtime
+     *         interpreter would; getValue_error also if the program
+     *         evaluates to something other than an integer, and
+     *         eval_error if it exceeds a capacity
+     */
+    constexpr int run(std::string_view program) {
+        source = program;
+        int root = parse_expression();
+
+        if (root < 0) {
+            throw parse_error();
+        }
+
+        Scope scope;
+        return as_integer(eval(root, scope));
+    }
+};
+
+/**
+ * Evaluates a DL program with the default capacities; usable to
+ * initialize a constexpr int.
+ */
+constexpr int constexpr_eval(std::string_view program) {
+    ConstexprInterpreter<> interpreter;
+    return interpreter.run(program);
+}
+
+#endif // __CONSTEXPR_DL_H__
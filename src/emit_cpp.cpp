@@ -0,0 +1,749 @@
+#include "emit_cpp.h"
+
+#include <cctype>
+#include <memory>
+#include <sstream>
+#include <unordered_map>
+#include <vector>
+#include "errors.h"
+
+// runtime support of the generated program, mirroring the interpreter's
+// values and error messages
+static const char *prelude = R"cpp(#include <iostream>
+#include <memory>
+#include <stdexcept>
+#include <string>
+
+namespace {
+
+struct Value;
+
+struct Object {
+    virtual ~Object() = default;
+
+    virtual Value call(Value argument);
+
+    virtual std::string to_string() const = 0;
+};
+
+struct Value {
+    int number = 0;
+    // nullptr for integers
+    std::shared_ptr<Object> object;
+
+    Value() = default;
+
+    Value(int number) : number(number) {}
+
+    Value(std::shared_ptr<Object> object) : object(std::move(object)) {}
+};
+
+using Box = std::shared_ptr<Value>;
+
+struct eval_error : std::exception {
+    const char* what() const noexcept override {
+        return "Evaluation error";
+    }
+};
+
+struct getValue_error : std::exception {
+    const char* what() const noexcept override {
+        return "get_value() error - not 'Val' type";
+    }
+};
+
+Value Object::call(Value) {
+    throw eval_error();
+}
+
+inline int as_int(const Value &value) {
+    if (value.object != nullptr) {
+        throw getValue_error();
+    }
+
+    return value.number;
+}
+
+inline std::string describe(const Value &value) {
+    if (value.object != nullptr) {
+        return value.object->to_string();
+    }
+
+    return "(val " + std::to_string(value.number) + ")";
+}
+
+inline Value invoke(const Value &callee, Value argument) {
+    if (callee.object == nullptr) {
+        throw eval_error();
+    }
+
+    return callee.object->call(std::move(argument));
+}
+
+inline Value unbound() {
+    throw std::out_of_range("unordered_map::at");
+}
+
+struct SetResult : Object {
+    const char *id;
+    Value value;
+
+    SetResult(const char *id, Value value) : id(id), value(std::move(value)) {}
+
+    std::string to_string() const override {
+        return std::string("(set ") + id + " " + describe(value) + ")";
+    }
+};
+
+inline Value set_result(const char *id, const Value &value) {
+    return Value(std::make_shared<SetResult>(id, value));
+}
+
+// as in Let::eval: a recursive closure holding its own box is dropped
+// when neither of them escaped
+inline void release(const Box &box) {
+    if (box.use_count() == 2 && box->object.use_count() == 1) {
+        box->object = nullptr;
+    }
+}
+
+)cpp";
+
+static const char *epilogue = R"cpp(
+} // namespace
+
+int main() {
+    try {
+        std::cout << describe(run()) << std::endl;
+    } catch (std::exception& Exception) {
+        std::cout << "ERROR: " << Exception.what() << std::endl;
+    }
+    return 0;
+}
+)cpp";
+
+/**
+ * A variable of the generated code: a let binding, a parameter, or the
+ * box a closure captured from an enclosing binding ('origin').
+ */
+struct Binding {
+    std::string id;
+    std::string name;
+    // the let value, nullptr for parameters and captures
+    Expression *value = nullptr;
+    Binding *origin = nullptr;
+    // captured by some function, so it lives in a Box
+    bool boxed = false;
+    // target of some 'set'
+    bool assigned = false;
+    // only ever holds integers, so it is an int local
+    bool integer = false;
+};
+
+/**
+ * C++ expression computing a value, valid after the statements emitted
+ * before it.
+ */
+struct Operand {
+    std::string code;
+    bool integer;
+    // a literal or a temporary, reading it again changes nothing
+    bool stable;
+};
+
+static std::string literal(const std::string &text) {
+    std::string result = "\"";
+
+    for (const char& c : text) {
+        switch (c) {
+            case '"':
+                result += "\\\"";
+                break;
+            case '\\':
+                result += "\\\\";
+                break;
+            case '\n':
+                result += "\\n";
+                break;
+            default:
+                if (static_cast<unsigned char>(c) < ' ' ||
+                    static_cast<unsigned char>(c) > '~') {
+                    const char digits[] = "01234567";
+                    unsigned char byte = c;
+                    result += {'\\', digits[byte >> 6],
+                               digits[(byte >> 3) & 7], digits[byte & 7]};
+                }
+                else {
+                    result += c;
+                }
+        }
+    }
+
+    return result + "\"";
+}
+
+static std::string as_int(const Operand &operand) {
+    return operand.integer ? operand.code : "as_int(" + operand.code + ")";
+}
+
+static std::string as_value(const Operand &operand) {
+    return operand.integer ? "Value(" + operand.code + ")" : operand.code;
+}
+
+class CppEmitter {
+    struct FunctionInfo {
+        size_t index;
+        std::vector<Binding*> captures;
+        Binding *param;
+    };
+
+    using Scope = std::vector<Binding*>;
+
+    std::vector<std::unique_ptr<Binding>> storage;
+    // Var and Set nodes to the binding they refer to, Let nodes to the
+    // one they introduce
+    std::unordered_map<Expression*, Binding*> bound;
+    std::unordered_map<Expression*, FunctionInfo> functions;
+    std::vector<Expression*> sets;
+    size_t names;
+
+    std::ostringstream structs;
+    std::ostringstream bodies;
+    std::ostringstream *out;
+    int indent;
+
+    ////////////// Analysis /////////////////
+
+    Binding* make_binding(const std::string &id, const char *prefix) {
+        std::string name = prefix + std::to_string(names++) + "_";
+
+        for (const char& c : id) {
+            if (isalnum(static_cast<unsigned char>(c)) || c == '_') {
+                name += c;
+            }
+        }
+
+        storage.push_back(std::make_unique<Binding>());
+        storage.back()->id = id;
+        storage.back()->name = name;
+        return storage.back().get();
+    }
+
+    static Binding* lookup(const Scope &scope, const std::string &id) {
+        for (auto binding = scope.rbegin(); binding != scope.rend();
+             ++binding) {
+            if ((*binding)->id == id) {
+                return *binding;
+            }
+        }
+
+        return nullptr;
+    }
+
+    /**
+     * Binds every variable reference to its declaration. Scopes are the
+     * same as at run time: a function body sees its parameter and the
+     * bindings it captured, nothing else.
+     */
+    void resolve(Expression &node, Scope &scope) {
+        if (node.is_fused()) {
+            throw emit_error("specialized program, prepare it with the "
+                             "patterns cleared: " + node.to_string());
+        }
+
+        switch (node.getType()) {
+            case var:
+                bound[&node] = lookup(scope, node.get_id());
+                break;
+            case set: {
+                resolve(*node.child(0), scope);
+                Binding *target = lookup(scope, node.get_id());
+
+                if (target == nullptr) {
+                    throw emit_error("set of unbound variable " +
+                                     node.get_id());
+                }
+
+                for (Binding *b = target; b != nullptr; b = b->origin) {
+                    b->assigned = true;
+                }
+
+                bound[&node] = target;
+                sets.push_back(&node);
+                break;
+            }
+            case let: {
+                Expression &value = *node.child(0);
+                Binding *binding = make_binding(node.get_id(), "v");
+                binding->value = &value;
+                bound[&node] = binding;
+
+                if (value.getType() == function) {
+                    scope.push_back(binding);
+                    resolve(value, scope);
+                }
+                else {
+                    resolve(value, scope);
+                    scope.push_back(binding);
+                }
+
+                resolve(*node.child(1), scope);
+                scope.pop_back();
+                break;
+            }
+            case function: {
+                auto &func = static_cast<Function&>(node);
+                FunctionInfo info{functions.size(), {}, nullptr};
+                Scope inner;
+
+                for (const auto& id : func.getCaptures()) {
+                    Binding *outer = lookup(scope, id);
+
+                    // unbound when the closure is made: not visible in it
+                    if (outer == nullptr) {
+                        continue;
+                    }
+
+                    Binding *slot = make_binding(id, "c");
+                    slot->origin = outer;
+                    slot->boxed = outer->boxed = true;
+                    inner.push_back(slot);
+                    info.captures.push_back(slot);
+                }
+
+                info.param = make_binding(func.get_id(), "v");
+                inner.push_back(info.param);
+                functions[&node] = info;
+                resolve(*func.child(0), inner);
+                break;
+            }
+            default:
+                for (size_t i = 0; i < node.child_count(); i++) {
+                    resolve(*node.child(i), scope);
+                }
+        }
+    }
+
+    bool is_integer(Expression &node) {
+        switch (node.getType()) {
+            case val:
+            case add:
+                return true;
+            case var:
+                return bound[&node] != nullptr && bound[&node]->integer;
+            case _if:
+                return is_integer(*node.child(2)) && is_integer(*node.child(3));
+            case let:
+                return is_integer(*node.child(1));
+            case block:
+                return is_integer(*node.child(node.child_count() - 1));
+            default:
+                return false;
+        }
+    }
+
+    /**
+     * Makes int locals of the unboxed let bindings that are initialized
+     * and set to integers only. Starts from all candidates and drops the
+     * ones that don't hold until nothing changes.
+     */
+    void infer_integers() {
+        for (auto& binding : storage) {
+            binding->integer = binding->value != nullptr && !binding->boxed &&
+                               binding->value->getType() != function;
+        }
+
+        bool changed = true;
+
+        while (changed) {
+            changed = false;
+
+            for (auto& binding : storage) {
+                if (binding->integer && !is_integer(*binding->value)) {
+                    binding->integer = false;
+                    changed = true;
+                }
+            }
+
+            for (Expression *node : sets) {
+                Binding *target = bound[node];
+
+                if (target->integer && !is_integer(*node->child(0))) {
+                    target->integer = false;
+                    changed = true;
+                }
+            }
+        }
+    }
+
+    /**
+     * @return the Function a variable always holds, or nullptr
+     */
+    Expression* known_function(Binding *binding) {
+        while (binding->origin != nullptr) {
+            binding = binding->origin;
+        }
+
+        if (binding->assigned || binding->value == nullptr ||
+            binding->value->getType() != function) {
+            return nullptr;
+        }
+
+        return binding->value;
+    }
+
+    // reading it neither throws nor depends on statements emitted after
+    bool quiet(Expression &node) {
+        return node.getType() == val ||
+               (node.getType() == var && bound[&node] != nullptr);
+    }
+
+    bool quiet_integer(Expression &node) {
+        return node.getType() == val ||
+               (node.getType() == var && bound[&node] != nullptr &&
+                bound[&node]->integer);
+    }
+
+    ////////////// Emission /////////////////
+
+    void line(const std::string &text) {
+        *out << std::string(indent * 4, ' ') << text << "\n";
+    }
+
+    Operand temporary(const Operand &operand) {
+        if (operand.stable) {
+            return operand;
+        }
+
+        std::string name = "t" + std::to_string(names++);
+        line(std::string(operand.integer ? "int " : "Value ") + name +
+             " = " + operand.code + ";");
+        return {name, operand.integer, true};
+    }
+
+    Operand integer(const Operand &operand) {
+        return {as_int(operand), true, operand.stable && operand.integer};
+    }
+
+    std::string function_name(Expression &node) {
+        return "Function_" + std::to_string(functions[&node].index);
+    }
+
+    void emit_function(Expression &node) {
+        FunctionInfo &info = functions[&node];
+        std::string name = function_name(node);
+        std::string members;
+        std::string params;
+        std::string inits;
+
+        for (Binding *slot : info.captures) {
+            members += "    Box " + slot->name + ";\n";
+            params += (params.empty() ? "" : ", ") + ("Box " + slot->name);
+            inits += (inits.empty() ? "" : ", ") +
+                     (slot->name + "(std::move(" + slot->name + "))");
+        }
+
+        structs << "struct " << name << " : Object {\n" << members;
+
+        if (info.captures.empty()) {
+            structs << "    static Value instance() {\n"
+                    << "        static const Value value(std::make_shared<"
+                    << name << ">());\n"
+                    << "        return value;\n"
+                    << "    }\n\n"
+                    << "    static Value apply(Value argument);\n";
+        }
+        else {
+            structs << "\n    " << (info.captures.size() == 1 ?
+                                    "explicit " : "")
+                    << name << "(" << params << ") :\n        " << inits
+                    << "\n    {}\n\n"
+                    << "    Value apply(Value argument);\n";
+        }
+
+        structs << "\n    Value call(Value argument) override {\n"
+                << "        return apply(std::move(argument));\n"
+                << "    }\n\n"
+                << "    std::string to_string() const override {\n"
+                << "        return " << literal(node.to_string()) << ";\n"
+                << "    }\n"
+                << "};\n\n";
+
+        std::ostringstream body;
+        std::ostringstream *outer = out;
+        int outer_indent = indent;
+        out = &body;
+        indent = 0;
+
+        if (info.param->boxed) {
+            line("Value " + name + "::apply(Value argument) {");
+            indent++;
+            line("Box " + info.param->name +
+                 " = std::make_shared<Value>(std::move(argument));");
+        }
+        else {
+            line("Value " + name + "::apply([[maybe_unused]] Value " +
+                 info.param->name + ") {");
+            indent++;
+        }
+
+        Operand result = emit(*node.child(0));
+        line("return " + as_value(result) + ";");
+        indent--;
+        line("}");
+        bodies << body.str() << "\n";
+
+        out = outer;
+        indent = outer_indent;
+    }
+
+    Operand emit_let(Expression &node, bool used) {
+        Binding *binding = bound[&node];
+        Expression &value = *node.child(0);
+        const std::string &name = binding->name;
+
+        if (value.getType() == function) {
+            if (binding->boxed) {
+                line("Box " + name + " = std::make_shared<Value>();");
+                line("*" + name + " = " + emit(value).code + ";");
+            }
+            else {
+                line("Value " + name + " = " + emit(value).code + ";");
+            }
+        }
+        else {
+            Operand initial = emit(value);
+
+            if (binding->boxed) {
+                line("Box " + name + " = std::make_shared<Value>(" +
+                     as_value(initial) + ");");
+            }
+            else if (binding->integer) {
+                line("int " + name + " = " + initial.code + ";");
+            }
+            else {
+                line("Value " + name + " = " + as_value(initial) + ";");
+            }
+        }
+
+        Operand result = emit(*node.child(1), used);
+
+        if (binding->boxed && known_function(binding) == &value) {
+            for (Binding *slot : functions[&value].captures) {
+                if (slot->origin == binding) {
+                    result = temporary(result);
+                    line("release(" + name + ");");
+                    break;
+                }
+            }
+        }
+
+        return result;
+    }
+
+    Operand emit_call(Expression &node) {
+        Expression &callee_node = *node.child(0);
+        Expression &argument_node = *node.child(1);
+        Expression *target = nullptr;
+
+        if (callee_node.getType() == var && bound[&callee_node] != nullptr) {
+            target = known_function(bound[&callee_node]);
+        }
+
+        // a function without captures is called without its value
+        bool lifted = target != nullptr && functions[target].captures.empty();
+        Operand callee{"", false, true};
+
+        if (!lifted) {
+            callee = emit(callee_node);
+
+            // a known callee is never set, the argument can't change it
+            if (target == nullptr && !quiet(argument_node)) {
+                callee = temporary(callee);
+            }
+        }
+
+        std::string argument = as_value(emit(argument_node));
+
+        if (lifted) {
+            return temporary({function_name(*target) + "::apply(" +
+                              argument + ")", false, false});
+        }
+
+        if (target != nullptr) {
+            return temporary({"static_cast<" + function_name(*target) +
+                              "&>(*" + callee.code + ".object).apply(" +
+                              argument + ")", false, false});
+        }
+
+        return temporary({"invoke(" + callee.code + ", " + argument + ")",
+                          false, false});
+    }
+
+    Operand emit_set(Expression &node, bool used) {
+        Binding *target = bound[&node];
+        Operand value = emit(*node.child(0));
+
+        if (used) {
+            value = temporary(value);
+        }
+
+        if (target->boxed) {
+            line("*" + target->name + " = " + as_value(value) + ";");
+        }
+        else if (target->integer) {
+            line(target->name + " = " + value.code + ";");
+        }
+        else {
+            line(target->name + " = " + as_value(value) + ";");
+        }
+
+        if (!used) {
+            return {"", false, true};
+        }
+
+        return temporary({"set_result(" + literal(node.get_id()) + ", " +
+                          as_value(value) + ")", false, false});
+    }
+
+    /**
+     * Emits the statements 'node' needs and returns its value. Operands
+     * are evaluated left to right, as the interpreter does.
+     *
+     * @param used false if the value is discarded, so a 'set' needn't
+     *        build its result
+     */
+    Operand emit(Expression &node, bool used = true) {
+        switch (node.getType()) {
+            case val: {
+                int integer = node.get_value();
+
+                // -2147483648 would be a long literal
+                if (integer == -2147483647 - 1) {
+                    return {"(-2147483647 - 1)", true, true};
+                }
+
+                return {std::to_string(integer), true, true};
+            }
+            case var: {
+                Binding *binding = bound[&node];
+
+                if (binding == nullptr) {
+                    return {"unbound()", false, false};
+                }
+
+                return {binding->boxed ? "(*" + binding->name + ")" :
+                        binding->name, binding->integer, false};
+            }
+            case add: {
+                Operand left = emit(*node.child(0));
+
+                if (!quiet_integer(*node.child(1))) {
+                    left = temporary(integer(left));
+                }
+
+                Operand right = emit(*node.child(1));
+                return {"(" + as_int(left) + " + " + as_int(right) + ")",
+                        true, false};
+            }
+            case _if: {
+                Operand left = emit(*node.child(0));
+
+                if (!quiet_integer(*node.child(1))) {
+                    left = temporary(integer(left));
+                }
+
+                Operand right = emit(*node.child(1));
+                bool integer = is_integer(node);
+                std::string result = "t" + std::to_string(names++);
+
+                line(integer ? "int " + result + " = 0;" :
+                     "Value " + result + ";");
+                line("if (" + as_int(left) + " > " + as_int(right) + ") {");
+
+                for (size_t branch = 2; branch < 4; branch++) {
+                    if (branch == 3) {
+                        line("else {");
+                    }
+
+                    indent++;
+                    Operand value = emit(*node.child(branch));
+                    line(result + " = " +
+                         (integer ? value.code : as_value(value)) + ";");
+                    indent--;
+                    line("}");
+                }
+
+                return {result, integer, true};
+            }
+            case let:
+                return emit_let(node, used);
+            case function: {
+                emit_function(node);
+                FunctionInfo &info = functions[&node];
+
+                if (info.captures.empty()) {
+                    return {function_name(node) + "::instance()", false, false};
+                }
+
+                std::string boxes;
+
+                for (Binding *slot : info.captures) {
+                    boxes += (boxes.empty() ? "" : ", ") + slot->origin->name;
+                }
+
+                return {"Value(std::make_shared<" + function_name(node) +
+                        ">(" + boxes + "))", false, false};
+            }
+            case call:
+                return emit_call(node);
+            case set:
+                return emit_set(node, used);
+            case block: {
+                size_t last = node.child_count() - 1;
+
+                for (size_t i = 0; i < last; i++) {
+                    Operand discarded = emit(*node.child(i), false);
+
+                    if (!discarded.stable) {
+                        line("static_cast<void>(" + discarded.code + ");");
+                    }
+                }
+
+                return emit(*node.child(last), used);
+            }
+            default:
+                throw emit_error("unexpected expression " + node.to_string());
+        }
+    }
+
+public:
+
+    CppEmitter() :
+        names(0),
+        out(nullptr),
+        indent(0)
+    {}
+
+    std::string emit_program(Expression &program) {
+        Scope scope;
+        resolve(program, scope);
+        infer_integers();
+
+        std::ostringstream run;
+        out = &run;
+        line("Value run() {");
+        indent++;
+        Operand result = emit(program);
+        line("return " + as_value(result) + ";");
+        indent--;
+        line("}");
+
+        return prelude + structs.str() + bodies.str() + run.str() + epilogue;
+    }
+};
+
+std::string emit_cpp(Expression &program) {
+    CppEmitter emitter;
+    return emitter.emit_program(program);
+}
@@ -0,0 +1,25 @@
+#ifndef __EMIT_CPP_H__
+#define __EMIT_CPP_H__
+
+#include <string>
+#include "expressions.h"
+
+/**
+ * Translates a program into a self-contained C++17 translation unit
+ * whose main() prints what DL_interpreter prints for it, including
+ * "ERROR: ..." for evaluation errors.
+ *
+ * Variables become locals, or shared boxes if a function captures them;
+ * integer-only locals are plain ints. Each Function becomes a closure
+ * struct, called directly when the callee is a variable that is bound
+ * to it and never set.
+ *
+ * @param program an unspecialized tree on which resolve_captures() ran
+ *
+ * @throws emit_error if the program sets a variable that is not bound
+ *         where the 'set' appears, which only the interpreter supports,
+ *         or if it contains fused nodes
+ */
+std::string emit_cpp(Expression &program);
+
+#endif // __EMIT_CPP_H__
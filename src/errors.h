@@ -5,7 +5,7 @@
 #include <string>
 #include <stdexcept>
 
-class eval_error : std::exception {
+class eval_error : public std::exception {
     std::string what_str;
 public:
     eval_error() : what_str("Evaluation error") {}
@@ -13,9 +13,17 @@ public:
     const char* what() const noexcept override {
         return what_str.c_str();
     }
+
+protected:
+    explicit eval_error(const std::string &what) : what_str(what) {}
 };
 
-class getValue_error : std::exception {
+class depth_error : public eval_error {
+public:
+    depth_error() : eval_error("Evaluation error - nested too deeply") {}
+};
+
+class getValue_error : public std::exception {
     std::string what_str;
 public:
     getValue_error() : what_str("get_value() error - not 'Val' type") {}
@@ -25,7 +33,7 @@ public:
     }
 };
 
-class parse_error : std::exception {
+class parse_error : public std::exception {
     std::string what_str;
 public:
     parse_error() : what_str("Parsing error") {}
@@ -35,4 +43,26 @@ public:
     }
 };
 
+class memory_error : public std::exception {
+    std::string what_str;
+public:
+    memory_error() : what_str("Memory budget exceeded") {}
+
+    const char* what() const noexcept override {
+        return what_str.c_str();
+    }
+};
+
+class emit_error : public std::exception {
+    std::string what_str;
+public:
+    explicit emit_error(const std::string &detail) :
+        what_str("emit_cpp() error - " + detail)
+    {}
+
+    const char* what() const noexcept override {
+        return what_str.c_str();
+    }
+};
+
 #endif // __ERRORS_H__
\ No newline at end of file
@@ -1,16 +1,223 @@
 #include "expressions.h"
 #include "errors.h"
 
-std::shared_ptr<Expression> Env::fromEnv(const std::string &V) {
+#include <algorithm>
+#include <unordered_set>
+
+std::shared_ptr<Expression> Env::fromEnv(const std::string &V, int slot) {
+    return lookup(V, slot);
+}
+
+const std::shared_ptr<Expression>& Env::lookup(const std::string &V,
+                                               int slot) {
+    const std::shared_ptr<Box> *held = frame_slot(slot);
+    Box *found;
+
     try {
-        std::shared_ptr<Expression> found = currentEnv.at(V);
-        return found;
+        found = held != nullptr ? held->get() : currentEnv.at(V).get();
     } catch (const std::out_of_range &exception) {
         throw exception;
     }
+
+    // the box keeps the forced value, later reads skip the thunk
+    if (found->value != nullptr && found->value->getType() == thunk) {
+        found->value = static_cast<Thunk&>(*found->value).force(*this);
+    }
+
+    return found->value;
+}
+
+const std::shared_ptr<Box>* Env::find(const std::string &V, int slot) {
+    const std::shared_ptr<Box> *held = frame_slot(slot);
+
+    if (held != nullptr) {
+        return held;
+    }
+
+    auto found = currentEnv.find(V);
+    return found != currentEnv.end() ? &found->second : nullptr;
+}
+
+std::shared_ptr<Expression> Env::delay(std::shared_ptr<Expression> expr,
+        const std::vector<VarRef> &refs) {
+    Bindings by_name;
+    Captured by_slot;
+    std::shared_ptr<Box> by_argument;
+
+    // each copy goes where the expression will look for it
+    for (const auto& ref : refs) {
+        const std::shared_ptr<Box> *found = find(ref.id, ref.slot);
+
+        if (found == nullptr) {
+            continue;
+        }
+
+        auto box = make_counted<Box, env_storage>((*found)->value);
+        track(box);
+
+        if (frame_slot(ref.slot) == nullptr) {
+            by_name.insert({ref.id, std::move(box)});
+        }
+        else if (ref.slot == VarRef::argument) {
+            by_argument = std::move(box);
+        }
+        else {
+            by_slot.resize(captured->size());
+            by_slot[ref.slot - 1] = std::move(box);
+        }
+    }
+
+    thunks_created++;
+    return make_counted<Thunk, runtime_values>(std::move(expr),
+            std::move(by_name), std::move(by_slot), std::move(by_argument));
+}
+
+std::shared_ptr<Box> Env::bind(const std::string &V, std::shared_ptr<Box> box) {
+    std::shared_ptr<Box> shadowed;
+    auto found = currentEnv.find(V);
+
+    if (found != currentEnv.end()) {
+        shadowed = std::move(found->second);
+        found->second = std::move(box);
+    }
+    else {
+        currentEnv.insert({V, std::move(box)});
+    }
+
+    return shadowed;
+}
+
+void Env::restore(const std::string &V, std::shared_ptr<Box> shadowed) {
+    if (shadowed != nullptr) {
+        currentEnv.insert_or_assign(V, std::move(shadowed));
+    }
+    else {
+        currentEnv.erase(V);
+    }
+}
+
+void Env::track(const std::shared_ptr<Box> &box) {
+    if (box->value == nullptr || box->value->getType() == val ||
+        box->value->getType() == function) {
+        return;
+    }
+
+    // drop boxes freed since, at doubling sizes to stay amortized O(1)
+    if (tracked.size() >= prune_at) {
+        tracked.erase(std::remove_if(tracked.begin(), tracked.end(),
+                [](const std::weak_ptr<Box> &box) { return box.expired(); }),
+                tracked.end());
+        prune_at = std::max<size_t>(64, 2 * tracked.size());
+    }
+
+    tracked.push_back(box);
+}
+
+void Env::release_cycles(const std::shared_ptr<Expression> &result) {
+    std::unordered_set<const Box*> reachable;
+    std::vector<Expression*> pending{result.get()};
+
+    auto reach = [&](const std::shared_ptr<Box> &box) {
+        if (box != nullptr && reachable.insert(box.get()).second) {
+            pending.push_back(box->value.get());
+        }
+    };
+
+    while (!pending.empty()) {
+        Expression *value = pending.back();
+        pending.pop_back();
+
+        if (value == nullptr) {
+            continue;
+        }
+
+        switch (value->getType()) {
+            case closure:
+                for (const auto& box :
+                        static_cast<Closure*>(value)->getCaptured()) {
+                    reach(box);
+                }
+                break;
+            case thunk:
+                for (const auto& [name, box] :
+                        static_cast<Thunk*>(value)->getCaptured()) {
+                    reach(box);
+                }
+                for (const auto& box :
+                        static_cast<Thunk*>(value)->getFrameCaptured()) {
+                    reach(box);
+                }
+                reach(static_cast<Thunk*>(value)->getFrameArgument());
+                pending.push_back(static_cast<Thunk*>(value)->getValue().get());
+                break;
+            case set:
+                pending.push_back(value->child(0).get());
+                break;
+            default:
+                break;
+        }
+    }
+
+    for (const auto& weak : tracked) {
+        std::shared_ptr<Box> box = weak.lock();
+
+        if (box != nullptr && reachable.count(box.get()) == 0) {
+            box->value = nullptr;
+        }
+    }
+
+    tracked.clear();
+    prune_at = 64;
+}
+
+////////////// Expression /////////////////
+
+size_t Expression::child_count() const {
+    return 0;
+}
+
+std::shared_ptr<Expression>& Expression::child(size_t) {
+    throw eval_error();
+}
+
+void Expression::bind_free_vars(size_t, FreeVars &) {}
+
+void Expression::note_free_vars(FreeVars &) {}
+
+void Expression::note_slots(const SlotScope &) {}
+
+bool Expression::is_fused() const {
+    return false;
+}
+
+bool deferrable(Expression &expr, const FreeVars &free) {
+    typeInHash type = expr.getType();
+    return !free.effects && type != val && type != var && type != function;
+}
+
+static void release_children(Expression &node,
+                             std::vector<std::shared_ptr<Expression>> &out) {
+    for (size_t i = 0; i < node.child_count(); i++) {
+        if (node.child(i) != nullptr) {
+            out.push_back(std::move(node.child(i)));
+        }
+    }
 }
 
-static Env env;
+void Expression::release_subtree() {
+    std::vector<std::shared_ptr<Expression>> pending;
+    release_children(*this, pending);
+
+    while (!pending.empty()) {
+        std::shared_ptr<Expression> node = std::move(pending.back());
+        pending.pop_back();
+
+        // shared subtrees are still owned elsewhere, leave them alone
+        if (node.use_count() == 1) {
+            release_children(*node, pending);
+        }
+    }
+}
 
 ////////////// Val /////////////////
 
@@ -31,8 +238,8 @@ Val& Val::operator= (const Val& that) {
     return *this;
 }
 
-std::shared_ptr<Expression> Val::eval() {
-    return std::make_shared<Val>(integer);
+std::shared_ptr<Expression> Val::eval(Env &) {
+    return make_counted<Val, runtime_values>(integer);
 }
 
 int Val::get_value() const {
@@ -51,11 +258,12 @@ std::string Val::to_string() const {
 
 Var::Var(std::string id):
     Expression(var),
-    id(std::move(id))
+    id(std::move(id)),
+    slot(VarRef::by_name)
 {}
 
-std::shared_ptr<Expression> Var::eval() {
-    return env.fromEnv(id);
+std::shared_ptr<Expression> Var::eval(Env &env) {
+    return env.fromEnv(id, slot);
 }
 
 bool Var::operator==(const Var& that) {
@@ -74,6 +282,14 @@ std::string Var::to_string() const {
     return "(var " + id + ")";
 }
 
+void Var::note_free_vars(FreeVars &free) {
+    free.names.insert(id);
+}
+
+void Var::note_slots(const SlotScope &scope) {
+    slot = slot_of(scope, id);
+}
+
 ////////////// Add /////////////////
 
 Add::Add(std::shared_ptr<Expression> left,
@@ -85,10 +301,23 @@ Add::Add(std::shared_ptr<Expression> left,
 
 Add::Add() : Add(nullptr, nullptr) {}
 
-std::shared_ptr<Expression> Add::eval() {
+Add::~Add() {
+    release_subtree();
+}
+
+size_t Add::child_count() const {
+    return 2;
+}
+
+std::shared_ptr<Expression>& Add::child(size_t index) {
+    return index == 0 ? left : right;
+}
+
+std::shared_ptr<Expression> Add::eval(Env &env) {
+    env.check_depth();
     std::shared_ptr<Expression> result =
-            std::make_shared<Val>(left->eval()->get_value() +
-                right->eval()->get_value());
+            make_counted<Val, runtime_values>(left->eval(env)->get_value() +
+                right->eval(env)->get_value());
     return result;
 }
 
@@ -118,14 +347,36 @@ If::If( std::shared_ptr<Expression> if_left_,  std::shared_ptr<Expression> if_ri
 
 If::If() : If(nullptr, nullptr, nullptr, nullptr) {}
 
-std::shared_ptr<Expression> If::eval() {
+If::~If() {
+    release_subtree();
+}
+
+size_t If::child_count() const {
+    return 4;
+}
+
+std::shared_ptr<Expression>& If::child(size_t index) {
+    switch (index) {
+        case 0:
+            return if_left_;
+        case 1:
+            return if_right_;
+        case 2:
+            return then_;
+        default:
+            return else_;
+    }
+}
+
+std::shared_ptr<Expression> If::eval(Env &env) {
+    env.check_depth();
     std::shared_ptr<Expression> result;
     
-    if (if_left_->eval()->get_value() > if_right_->eval()->get_value()) {
-        result = then_->eval();
+    if (if_left_->eval(env)->get_value() > if_right_->eval(env)->get_value()) {
+        result = then_->eval(env);
     }
     else {
-        result = else_->eval();
+        result = else_->eval(env);
     }
     
     return result;
@@ -152,37 +403,60 @@ Let::Let (std::string id, std::shared_ptr<Expression> id_expr,
         Expression(let),
         id(std::move(id)),
         id_expr(std::move(id_expr)),
-        in(std::move(in))
+        in(std::move(in)),
+        id_deferred(false)
 {}
 
 Let::Let() :
     Let("", nullptr, nullptr)
 {}
 
-std::shared_ptr<Expression> Let::eval()  {
-    std::shared_ptr<Expression> tempEnv;
-    std::shared_ptr<Expression> evalId = id_expr->eval();
-    auto Found_by_Id = env.currentEnv.find(id);
-    
-    if (Found_by_Id != env.currentEnv.end()) {
-        tempEnv = Found_by_Id->second;
-        env.currentEnv.erase(Found_by_Id);
-    }
-    
-    env.currentEnv.insert({id, evalId});
-    
-    //adds env configuration into envMap when id function declared
+Let::~Let() {
+    release_subtree();
+}
+
+size_t Let::child_count() const {
+    return 2;
+}
+
+std::shared_ptr<Expression>& Let::child(size_t index) {
+    return index == 0 ? id_expr : in;
+}
+
+std::shared_ptr<Expression> Let::eval(Env &env)  {
+    env.check_depth();
+    std::shared_ptr<Box> box;
+    std::shared_ptr<Box> shadowed;
+
+    // a function is bound before it is evaluated, so it can capture
+    // its own name and call itself
     if (id_expr->getType() == function) {
-        env.envMap.insert({id, env.currentEnv});
+        box = make_counted<Box, env_storage>(nullptr);
+        shadowed = env.bind(id, box);
+        box->value = id_expr->eval(env);
     }
-    
-    auto result = in->eval();
-    env.currentEnv.erase(id);
-    
-    if (tempEnv != nullptr) {
-        env.currentEnv.insert({id, tempEnv});
+    else if (env.lazy && id_deferred) {
+        box = make_counted<Box, env_storage>(
+                env.delay(id_expr, id_free_vars));
+        shadowed = env.bind(id, box);
     }
-    
+    else {
+        box = make_counted<Box, env_storage>(id_expr->eval(env));
+        shadowed = env.bind(id, box);
+    }
+
+    env.track(box);
+    auto result = in->eval(env);
+    env.restore(id, std::move(shadowed));
+
+    // the closure of a recursive function holds its own box; unless
+    // either of them escaped, break the cycle so both get freed
+    if (box.use_count() == 2 && box->value.use_count() == 1 &&
+        box->value->getType() == closure &&
+        static_cast<Closure&>(*box->value).holds(box.get())) {
+        box->value = nullptr;
+    }
+
     return result;
 }
 
@@ -191,7 +465,7 @@ int Let::get_value() const  {
 }
 
 std::string Let::get_id() const  {
-    throw parse_error();
+    return id;
 }
 
 std::string Let::to_string() const  {
@@ -199,6 +473,27 @@ std::string Let::to_string() const  {
             " in " + in->to_string() + ")";
 }
 
+void Let::bind_free_vars(size_t index, FreeVars &free) {
+    if (index == 0) {
+        id_deferred = deferrable(*id_expr, free);
+        id_free_vars.clear();
+
+        for (const auto& name : free.names) {
+            id_free_vars.push_back({name});
+        }
+    }
+
+    if (index == 1 || id_expr->getType() == function) {
+        free.names.erase(id);
+    }
+}
+
+void Let::note_slots(const SlotScope &scope) {
+    for (auto& ref : id_free_vars) {
+        ref.slot = slot_of(scope, ref.id);
+    }
+}
+
 ////////////// Function /////////////////
 
 Function::Function(std::string id, std::shared_ptr<Expression> func_expr) :
@@ -207,8 +502,55 @@ Function::Function(std::string id, std::shared_ptr<Expression> func_expr) :
         funcBody(std::move(func_expr))
 {}
 
-std::shared_ptr<Expression> Function::eval()  {
-    return std::make_shared<Function>(arg_id, funcBody);
+Function::~Function() {
+    release_subtree();
+}
+
+size_t Function::child_count() const {
+    return 1;
+}
+
+std::shared_ptr<Expression>& Function::child(size_t) {
+    return funcBody;
+}
+
+std::shared_ptr<Expression> Function::eval(Env &env)  {
+    // lambda-lifted: nothing to capture, the literal is its own value
+    if (captures.empty()) {
+        return shared_from_this();
+    }
+
+    Captured captured;
+    captured.reserve(captures.size());
+
+    for (size_t i = 0; i < captures.size(); i++) {
+        const std::shared_ptr<Box> *found = env.find(captures[i],
+                                                     capture_slots[i]);
+        captured.push_back(found != nullptr ? *found : nullptr);
+    }
+
+    return make_counted<Closure, runtime_values>(shared_from_this(),
+                                                 std::move(captured));
+}
+
+std::shared_ptr<Expression> Function::apply(Env &env,
+        std::shared_ptr<Expression> argument,
+        const Captured &captured) {
+    // only the 'let's and 'set's of the body add names to it
+    Bindings callEnv;
+    auto box = make_counted<Box, env_storage>(std::move(argument));
+    env.track(box);
+
+    const Captured *outer_captured = env.captured;
+    const std::shared_ptr<Box> *outer_argument = env.argument;
+    env.captured = &captured;
+    env.argument = &box;
+    std::swap(env.currentEnv, callEnv);
+    std::shared_ptr<Expression> result = funcBody->eval(env);
+    std::swap(env.currentEnv, callEnv);
+    env.captured = outer_captured;
+    env.argument = outer_argument;
+    return result;
 }
 
 int Function::get_value() const  {
@@ -223,108 +565,120 @@ std::shared_ptr<Expression> Function::getBody () {
     return funcBody;
 }
 
+const std::vector<std::string>& Function::getCaptures() const {
+    return captures;
+}
+
 std::string Function::to_string() const  {
     return "(function " + arg_id + " " +
             funcBody->to_string() + ")";
 }
 
+void Function::bind_free_vars(size_t, FreeVars &free) {
+    free.names.erase(arg_id);
+}
+
+void Function::note_free_vars(FreeVars &free) {
+    captures.assign(free.names.begin(), free.names.end());
+}
+
+void Function::note_slots(const SlotScope &scope) {
+    capture_slots.clear();
+
+    for (const auto& name : captures) {
+        capture_slots.push_back(slot_of(scope, name));
+    }
+}
+
+////////////// Closure /////////////////
+
+Closure::Closure(std::shared_ptr<Function> func, Captured captured) :
+    Expression(closure),
+    func(std::move(func)),
+    captured(std::move(captured))
+{}
+
+std::shared_ptr<Expression> Closure::eval(Env &)  {
+    return make_counted<Closure, runtime_values>(func, captured);
+}
+
+std::shared_ptr<Expression> Closure::apply(Env &env,
+                                           std::shared_ptr<Expression> argument) {
+    return func->apply(env, std::move(argument), captured);
+}
+
+bool Closure::holds(const Box *box) const {
+    for (const auto& captured_box : captured) {
+        if (captured_box.get() == box) {
+            return true;
+        }
+    }
+
+    return false;
+}
+
+const Captured& Closure::getCaptured() const {
+    return captured;
+}
+
+int Closure::get_value() const  {
+    throw getValue_error();
+}
+
+std::string Closure::get_id() const  {
+    return func->get_id();
+}
+
+std::string Closure::to_string() const  {
+    return func->to_string();
+}
+
 ////////////// Call /////////////////
 
 Call::Call (std::shared_ptr<Expression> func,  std::shared_ptr<Expression> expr) :
     Expression(call),
     func_expression(std::move(func)),
-    arg_expression(std::move(expr))
+    arg_expression(std::move(expr)),
+    arg_deferred(false)
 {}
 
 Call::Call () : Call(nullptr, nullptr) {}
 
-std::shared_ptr<Expression> Call::eval()  {
-/*
-    std::unordered_map<std::string, std::shared_ptr<Expression>> Env_in_call;
-    std::shared_ptr<Expression> result;
-    std::shared_ptr<Function> Func;
-    std::string FuncId;
-    if (func_expression->getType() == var) {
-        std::shared_ptr<Expression> envFunc =
-                env.at(func_expression->get_id());
-        if (envFunc->getType() == function) {
-            FuncId = envFunc->get_id();
-            Func = std::static_pointer_cast<Function>(envFunc->eval());
-            Env_in_call.insert({func_expression->get_id(), Func});
-        } else {
-            throw eval_error();
-        }
-    } else if (func_expression->getType() == function) {
-        FuncId = func_expression->get_id();
-        Func = std::static_pointer_cast<Function>(func_expression->eval());
-    } else {
-        throw parse_error();
-    }
-
-    std::shared_ptr<Expression> evalArg = arg_expression->eval();
-    std::swap(Env_in_call, env);
-    env.insert({FuncId, evalArg});
-    result = Func->getBody()->eval();
-    std::swap(env, Env_in_call);
-    return result;
-*/
+Call::~Call() {
+    release_subtree();
+}
 
-/* with Lexical scope's support:*/
+size_t Call::child_count() const {
+    return 2;
+}
 
-    std::shared_ptr<Expression> result;
-    std::shared_ptr<Function> Func;
-    std::string FuncId;
-    bool copiedEnv = false;
-    std::unordered_map<std::string, std::shared_ptr<Expression>> Env_in_call;
-
-    if (func_expression->getType() == var) {
-        std::shared_ptr<Expression> envFunc =
-                                env.currentEnv.at(func_expression->get_id());
-                                
-        if (envFunc->getType() == function) {
-            Env_in_call = env.envMap.at(func_expression->get_id());
-            copiedEnv = true;
-            FuncId = envFunc->get_id();
-            Func = std::static_pointer_cast<Function>(envFunc->eval());
-        } 
-        else {
-            throw eval_error();
-        }
-    } 
-    else if (func_expression->getType() == function) {
-        std::swap(env.currentEnv, Env_in_call);
-        FuncId = func_expression->get_id();
-        Func = std::static_pointer_cast<Function>(func_expression->eval());
-    } 
-    else {
-        throw eval_error();
-    }
+std::shared_ptr<Expression>& Call::child(size_t index) {
+    return index == 0 ? func_expression : arg_expression;
+}
 
-    std::shared_ptr<Expression> tempEnv = nullptr;
+std::shared_ptr<Expression> Call::eval(Env &env)  {
+    env.check_depth();
+    std::shared_ptr<Expression> callee = func_expression->eval(env);
+    std::shared_ptr<Expression> argument = env.lazy && arg_deferred ?
+            env.delay(arg_expression, arg_free_vars) :
+            arg_expression->eval(env);
+    return invoke(env, callee, std::move(argument));
+}
 
-    if (Env_in_call.find(FuncId) != Env_in_call.end()) {
-        tempEnv = Env_in_call.at(FuncId);
-        Env_in_call.erase(FuncId);
+std::shared_ptr<Expression> Call::invoke(Env &env,
+        const std::shared_ptr<Expression> &callee,
+        std::shared_ptr<Expression> argument) {
+    if (callee->getType() == closure) {
+        return std::static_pointer_cast<Closure>(callee)->apply(env,
+                std::move(argument));
     }
 
-    Env_in_call.insert({FuncId, arg_expression->eval()});
-    result = Func->getBody()->eval();
-    Env_in_call.erase(FuncId);
-
-    if (tempEnv != nullptr) {
-        Env_in_call.insert({FuncId, tempEnv});
-    }
-    
-    if (copiedEnv) {
-        for (const auto& [key, expr] : Env_in_call) {
-            env.currentEnv.insert_or_assign(key, expr); //mb emplace?
-        }
-    }
-    else {
-        std::swap(Env_in_call, env.currentEnv);
+    if (callee->getType() == function) {
+        return std::static_pointer_cast<Function>(callee)->apply(env,
+                std::move(argument), {});
     }
 
-    return result;
+    throw eval_error();
 }
 
 int Call::get_value() const  {
@@ -340,28 +694,135 @@ std::string Call::to_string() const  {
             arg_expression->to_string() + ")";
 }
 
+void Call::bind_free_vars(size_t index, FreeVars &free) {
+    if (index == 1) {
+        arg_deferred = deferrable(*arg_expression, free);
+        arg_free_vars.clear();
+
+        for (const auto& name : free.names) {
+            arg_free_vars.push_back({name});
+        }
+    }
+}
+
+void Call::note_free_vars(FreeVars &free) {
+    // the callee is unknown until run time, it may 'set' anything
+    free.effects = true;
+}
+
+void Call::note_slots(const SlotScope &scope) {
+    for (auto& ref : arg_free_vars) {
+        ref.slot = slot_of(scope, ref.id);
+    }
+}
+
+////////////// Thunk /////////////////
+
+Thunk::Thunk(std::shared_ptr<Expression> expr, Bindings captured,
+             Captured frame_captured, std::shared_ptr<Box> frame_argument) :
+    Expression(thunk),
+    expr(std::move(expr)),
+    captured(std::move(captured)),
+    frame_captured(std::move(frame_captured)),
+    frame_argument(std::move(frame_argument))
+{}
+
+std::shared_ptr<Expression> Thunk::eval(Env &env)  {
+    return force(env);
+}
+
+std::shared_ptr<Expression> Thunk::force(Env &env) {
+    if (value == nullptr) {
+        const Captured *outer_captured = env.captured;
+        const std::shared_ptr<Box> *outer_argument = env.argument;
+        env.captured = &frame_captured;
+        env.argument = &frame_argument;
+        std::swap(env.currentEnv, captured);
+        value = expr->eval(env);
+        std::swap(env.currentEnv, captured);
+        env.captured = outer_captured;
+        env.argument = outer_argument;
+
+        expr = nullptr;
+        captured.clear();
+        frame_captured.clear();
+        frame_argument = nullptr;
+        env.thunks_forced++;
+    }
+
+    return value;
+}
+
+const Bindings& Thunk::getCaptured() const {
+    return captured;
+}
+
+const Captured& Thunk::getFrameCaptured() const {
+    return frame_captured;
+}
+
+const std::shared_ptr<Box>& Thunk::getFrameArgument() const {
+    return frame_argument;
+}
+
+const std::shared_ptr<Expression>& Thunk::getValue() const {
+    return value;
+}
+
+int Thunk::get_value() const  {
+    throw getValue_error();
+}
+
+std::string Thunk::get_id() const  {
+    throw parse_error();
+}
+
+std::string Thunk::to_string() const  {
+    return value != nullptr ? value->to_string() : expr->to_string();
+}
+
 ////////////// Set /////////////////
 
 Set::Set(std::string id, std::shared_ptr<Expression> expr) :
     Expression(set),
     id(std::move(id)),
+    slot(VarRef::by_name),
     e_val(std::move(expr))
 {}
 
+Set::~Set() {
+    release_subtree();
+}
+
+size_t Set::child_count() const {
+    return 1;
+}
+
+std::shared_ptr<Expression>& Set::child(size_t) {
+    return e_val;
+}
+
 std::string Set::get_id () const  {
     return id;
 }
 
-std::shared_ptr<Expression> Set::eval()  {
-    std::shared_ptr<Expression> temp;
-    auto envFoundById = env.currentEnv.find(id);
-    
-    if (envFoundById != env.currentEnv.end()) {
-        env.currentEnv.erase(envFoundById);
+std::shared_ptr<Expression> Set::eval(Env &env)  {
+    env.check_depth();
+    std::shared_ptr<Expression> value = e_val->eval(env);
+    const std::shared_ptr<Box> *found = env.find(id, slot);
+
+    // writes through the box, so closures sharing it see the new value
+    if (found != nullptr) {
+        (*found)->value = value;
+        env.track(*found);
     }
-    
-    env.currentEnv.insert({id, e_val});
-    return std::make_shared<Set>(id, e_val);
+    else {
+        auto box = make_counted<Box, env_storage>(value);
+        env.track(box);
+        env.currentEnv.insert({id, std::move(box)});
+    }
+
+    return make_counted<Set, runtime_values>(id, value);
 }
 
 int Set::get_value () const  {
@@ -372,6 +833,15 @@ std::string Set::to_string() const  {
     return "(set " + id + " " + e_val->to_string() + ")";
 }
 
+void Set::note_free_vars(FreeVars &free) {
+    free.names.insert(id);
+    free.effects = true;
+}
+
+void Set::note_slots(const SlotScope &scope) {
+    slot = slot_of(scope, id);
+}
+
 ////////////// Block /////////////////
 
 Block::Block(std::vector<std::shared_ptr<Expression>> expr_array) :
@@ -379,11 +849,24 @@ Block::Block(std::vector<std::shared_ptr<Expression>> expr_array) :
     expr_array(std::move(expr_array))
 {}
 
-std::shared_ptr<Expression> Block::eval()  {
+Block::~Block() {
+    release_subtree();
+}
+
+size_t Block::child_count() const {
+    return expr_array.size();
+}
+
+std::shared_ptr<Expression>& Block::child(size_t index) {
+    return expr_array[index];
+}
+
+std::shared_ptr<Expression> Block::eval(Env &env)  {
+    env.check_depth();
     std::shared_ptr<Expression> result;
     
     for (auto& expr : expr_array) {
-        result = expr->eval();
+        result = expr->eval(env);
     }
     
     return result;
@@ -406,4 +889,122 @@ std::string Block::to_string() const  {
     
     result += ")";
     return result;
-}
\ No newline at end of file
+}
+
+////////////// Free variables /////////////////
+
+int slot_of(const SlotScope &scope, const std::string &id) {
+    auto found = scope.find(id);
+    return found != scope.end() ? found->second : VarRef::by_name;
+}
+
+/**
+ * Pre-order walk giving each node the slots of its position: those of
+ * the innermost enclosing function, less the names 'let' shadows.
+ */
+static void assign_slots(Expression &program) {
+    struct Pending {
+        Expression *node;
+        size_t next_child;
+        // what the node changed in 'scope', undone when leaving it
+        SlotScope outer;
+        bool shadowing;
+        int shadowed;
+    };
+
+    SlotScope scope;
+    std::vector<Pending> stack;
+    program.note_slots(scope);
+    stack.push_back({&program, 0, {}, false, VarRef::by_name});
+
+    while (!stack.empty()) {
+        Pending &top = stack.back();
+        Expression &node = *top.node;
+
+        if (top.next_child == node.child_count()) {
+            if (node.getType() == function) {
+                scope = std::move(top.outer);
+            }
+            else if (top.shadowing) {
+                scope[node.get_id()] = top.shadowed;
+            }
+
+            stack.pop_back();
+            continue;
+        }
+
+        size_t index = top.next_child++;
+
+        if (node.getType() == function) {
+            // the body sees only the argument and the captured boxes
+            const auto& captures = static_cast<Function&>(node).getCaptures();
+            top.outer = std::move(scope);
+            scope.clear();
+
+            for (size_t i = 0; i < captures.size(); i++) {
+                scope[captures[i]] = static_cast<int>(i) + 1;
+            }
+
+            scope[node.get_id()] = VarRef::argument;
+        }
+        else if (node.getType() == let && !top.shadowing &&
+                 (index == 1 || node.child(0)->getType() == function)) {
+            top.shadowing = true;
+            top.shadowed = slot_of(scope, node.get_id());
+            scope[node.get_id()] = VarRef::by_name;
+        }
+
+        Expression *child = node.child(index).get();
+
+        if (child != nullptr) {
+            child->note_slots(scope);
+            stack.push_back({child, 0, {}, false, VarRef::by_name});
+        }
+    }
+}
+
+std::set<std::string> resolve_captures(Expression &program) {
+    struct Pending {
+        Expression *node;
+        size_t next_child;
+        FreeVars free;
+    };
+
+    // post-order walk, each entry collects the free variables of its node
+    std::vector<Pending> stack;
+    stack.push_back({&program, 0, {}});
+
+    while (true) {
+        Pending &top = stack.back();
+
+        if (top.next_child < top.node->child_count()) {
+            Expression *child = top.node->child(top.next_child++).get();
+
+            if (child != nullptr) {
+                stack.push_back({child, 0, {}});
+            }
+            continue;
+        }
+
+        top.node->note_free_vars(top.free);
+
+        if (stack.size() == 1) {
+            break;
+        }
+
+        FreeVars free = std::move(top.free);
+        stack.pop_back();
+        Pending &parent = stack.back();
+        parent.node->bind_free_vars(parent.next_child - 1, free);
+
+        if (free.names.size() > parent.free.names.size()) {
+            std::swap(free.names, parent.free.names);
+        }
+
+        parent.free.names.insert(free.names.begin(), free.names.end());
+        parent.free.effects |= free.effects;
+    }
+
+    assign_slots(program);
+    return std::move(stack.back().free.names);
+}
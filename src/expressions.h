@@ -1,15 +1,64 @@
 #ifndef __EXPRESSIONS_H__
 #define __EXPRESSIONS_H__
 
+#include <cstdint>
 #include <memory>
+#include <set>
 #include <string>
 #include <vector>
 #include <unordered_map>
+#include "accounting.h"
+#include "errors.h"
 
 enum typeInHash {val = 1, var = 2, add = 3, _if = 4, let = 5,
-    function = 6, call = 7, set = 8, block = 9};
+    function = 6, call = 7, set = 8, block = 9, closure = 10, thunk = 11};
 
 struct Env;
+struct Box;
+
+/**
+ * Variable bindings and captured boxes, counted as env storage.
+ */
+using Bindings = std::unordered_map<std::string, std::shared_ptr<Box>,
+        std::hash<std::string>, std::equal_to<std::string>,
+        CountingAllocator<std::pair<const std::string, std::shared_ptr<Box>>,
+                          env_storage>>;
+
+using Captured = std::vector<std::shared_ptr<Box>,
+        CountingAllocator<std::shared_ptr<Box>, env_storage>>;
+
+/**
+ * What a subtree needs from its surroundings: the variables it reads or
+ * sets without binding them, and whether it may have side effects.
+ */
+struct FreeVars {
+    std::set<std::string> names;
+    bool effects = false;
+};
+
+/**
+ * Where a variable is found inside a function body: the argument, one
+ * of the captured boxes, or by name in Env::currentEnv, which holds the
+ * 'let' bindings and everything outside functions.
+ */
+struct VarRef {
+    static constexpr int by_name = -1;
+    static constexpr int argument = 0;
+    // captured box i of the running function is slot i + 1
+
+    std::string id;
+    int slot = by_name;
+};
+
+/**
+ * The slots of the variables visible in the function being resolved.
+ */
+using SlotScope = std::unordered_map<std::string, int>;
+
+/**
+ * @return the slot of 'id' in 'scope', VarRef::by_name if it has none
+ */
+int slot_of(const SlotScope &scope, const std::string &id);
 
 class Expression {
     const typeInHash type;
@@ -23,13 +72,16 @@ public:
      * Evaluates the expression and returns a shared pointer
      * to a Val object representing the integer value.
      *
+     * @param env the variable bindings of this evaluation; separate
+     *        Env objects may be used concurrently on one tree
+     *
      * @return A shared pointer to a Val object representing the 
      *         integer value.
      *
      * @throws ErrorType A description of the error that can occur 
      *         during evaluation.
      */
-    virtual std::shared_ptr<Expression> eval() = 0;
+    virtual std::shared_ptr<Expression> eval(Env &env) = 0;
 
     virtual int get_value() const = 0;
 
@@ -40,7 +92,8 @@ public:
      *
      * @return the ID of the object
      * 
-     * @throws parse_error for all Expression classes except Var 
+     * @throws parse_error for all Expression classes except Var, Let,
+     *         Function and Set
      */
     virtual std::string get_id () const = 0;
 
@@ -49,6 +102,47 @@ public:
     typeInHash getType () {
         return type;
     }
+
+    /**
+     * Direct subexpressions, in source order. Used by the passes that
+     * walk the tree without recursion.
+     */
+    virtual size_t child_count() const;
+
+    virtual std::shared_ptr<Expression>& child(size_t index);
+
+    /**
+     * Gets the free variables of child number 'index' and removes those
+     * this expression binds around it.
+     */
+    virtual void bind_free_vars(size_t index, FreeVars &free);
+
+    /**
+     * Adds what this expression needs by itself, once the free variables
+     * of all children are merged into 'free'.
+     */
+    virtual void note_free_vars(FreeVars &free);
+
+    /**
+     * Records the slots of the variables this expression reads or sets
+     * by itself, 'scope' being the one of its position in the program.
+     */
+    virtual void note_slots(const SlotScope &scope);
+
+    /**
+     * @return true for the fused nodes of specialize.h, which report the
+     *         type they replace but lay out their children differently
+     */
+    virtual bool is_fused() const;
+
+protected:
+
+    /**
+     * Destroys the subtree below this node with an explicit stack, so
+     * deeply nested programs don't overflow the native one. Called from
+     * the destructors of the compound expressions.
+     */
+    void release_subtree();
 };
 
 class Val : public Expression {
@@ -64,7 +158,7 @@ public:
 
     Val& operator= (const Val& that);
 
-    std::shared_ptr<Expression> eval() override;
+    std::shared_ptr<Expression> eval(Env &env) override;
 
     int get_value() const override;
 
@@ -75,13 +169,14 @@ public:
 
 class Var : public Expression {
     std::string id;
+    int slot;
 public:
 
     explicit Var(std::string id);
 
     ~Var() override = default;
 
-    std::shared_ptr<Expression> eval() override;
+    std::shared_ptr<Expression> eval(Env &env) override;
 
     bool operator==(const Var& that);
 
@@ -90,6 +185,10 @@ public:
     int get_value() const override;
 
     std::string to_string() const override;
+
+    void note_free_vars(FreeVars &free) override;
+
+    void note_slots(const SlotScope &scope) override;
 };
 
 class Add : public  Expression {
@@ -101,15 +200,19 @@ public:
 
     Add();
 
-    ~Add() override = default;
+    ~Add() override;
 
-    std::shared_ptr<Expression> eval() override;
+    std::shared_ptr<Expression> eval(Env &env) override;
 
     int get_value() const override;
 
     std::string get_id() const override;
 
     std::string to_string() const override;
+
+    size_t child_count() const override;
+
+    std::shared_ptr<Expression>& child(size_t index) override;
 };
 
 class If : public  Expression {
@@ -124,21 +227,28 @@ public:
 
     If(); 
 
-    ~If() override = default;
+    ~If() override;
 
-    std::shared_ptr<Expression> eval() override;
+    std::shared_ptr<Expression> eval(Env &env) override;
 
     int get_value() const override;
 
     std::string get_id() const override;
 
     std::string to_string() const override;
+
+    size_t child_count() const override;
+
+    std::shared_ptr<Expression>& child(size_t index) override;
 };
 
 class Let : public  Expression {
     std::string id;
     std::shared_ptr<Expression> id_expr;
     std::shared_ptr<Expression> in;
+    // set by resolve_captures(): id_expr may become a thunk in lazy mode
+    bool id_deferred;
+    std::vector<VarRef> id_free_vars;
 public:
 
     Let (std::string id, std::shared_ptr<Expression> id_expr,
@@ -146,27 +256,44 @@ public:
 
     Let();
 
-    ~Let() override = default;
+    ~Let() override;
 
-    std::shared_ptr<Expression> eval() override;
+    std::shared_ptr<Expression> eval(Env &env) override;
 
     int get_value() const override;
 
     std::string get_id() const override;
 
     std::string to_string() const override;
+
+    size_t child_count() const override;
+
+    std::shared_ptr<Expression>& child(size_t index) override;
+
+    void bind_free_vars(size_t index, FreeVars &free) override;
+
+    void note_slots(const SlotScope &scope) override;
 };
 
-class Function : public  Expression {
+/**
+ * Function literal. Evaluates to a Closure holding the boxes of the
+ * variables listed in 'captures', or to itself when it captures nothing.
+ * 'captures' and the slots they are taken from are filled by
+ * resolve_captures() before evaluation.
+ */
+class Function : public  Expression,
+                 public std::enable_shared_from_this<Function> {
     std::string arg_id;
     std::shared_ptr<Expression> funcBody;
+    std::vector<std::string> captures;
+    std::vector<int> capture_slots;
 public:
 
     Function(std::string id, std::shared_ptr<Expression> func_expr);
 
-    ~Function() override = default;
+    ~Function() override;
 
-    std::shared_ptr<Expression> eval() override;
+    std::shared_ptr<Expression> eval(Env &env) override;
 
     int get_value() const override;
 
@@ -174,21 +301,140 @@ public:
 
     std::shared_ptr<Expression> getBody();
 
+    const std::vector<std::string>& getCaptures() const;
+
+    /**
+     * Evaluates the body with 'argument' bound to the parameter and
+     * 'captured[i]' bound to 'captures[i]'; nothing else is visible.
+     * The body reads both through their slots, see VarRef.
+     */
+    std::shared_ptr<Expression> apply(Env &env,
+            std::shared_ptr<Expression> argument,
+            const Captured &captured);
+
+    std::string to_string() const override;
+
+    size_t child_count() const override;
+
+    std::shared_ptr<Expression>& child(size_t index) override;
+
+    void bind_free_vars(size_t index, FreeVars &free) override;
+
+    void note_free_vars(FreeVars &free) override;
+
+    void note_slots(const SlotScope &scope) override;
+};
+
+/**
+ * Runtime value of a Function that captures variables.
+ */
+class Closure : public Expression {
+    std::shared_ptr<Function> func;
+    Captured captured;
+public:
+
+    Closure(std::shared_ptr<Function> func, Captured captured);
+
+    ~Closure() override = default;
+
+    std::shared_ptr<Expression> eval(Env &env) override;
+
+    std::shared_ptr<Expression> apply(Env &env,
+                                      std::shared_ptr<Expression> argument);
+
+    /**
+     * @return true if 'box' is among the captured variables
+     */
+    bool holds(const Box *box) const;
+
+    const Captured& getCaptured() const;
+
+    int get_value() const override;
+
+    std::string get_id() const override;
+
     std::string to_string() const override;
 };
 
 class Call : public  Expression {
      std::shared_ptr<Expression> func_expression;
      std::shared_ptr<Expression> arg_expression;
+     // set by resolve_captures(): the argument may become a thunk
+     bool arg_deferred;
+     std::vector<VarRef> arg_free_vars;
 public:
 
     Call (std::shared_ptr<Expression> func,  std::shared_ptr<Expression> expr);
 
     Call (); 
 
-    ~Call() override = default;
+    ~Call() override;
+
+    std::shared_ptr<Expression> eval(Env &env) override;
 
-    std::shared_ptr<Expression> eval() override;
+    /**
+     * Calls the function value 'callee' with an evaluated argument.
+     *
+     * @throws eval_error if 'callee' is not a function
+     */
+    static std::shared_ptr<Expression> invoke(Env &env,
+            const std::shared_ptr<Expression> &callee,
+            std::shared_ptr<Expression> argument);
+
+    int get_value() const override;
+
+    std::string get_id() const override;
+
+    std::string to_string() const override;
+
+    size_t child_count() const override;
+
+    std::shared_ptr<Expression>& child(size_t index) override;
+
+    void bind_free_vars(size_t index, FreeVars &free) override;
+
+    void note_free_vars(FreeVars &free) override;
+
+    void note_slots(const SlotScope &scope) override;
+};
+
+/**
+ * Deferred evaluation of a side-effect free expression in lazy mode.
+ * Holds copies of the bindings the expression reads, so later 'set's
+ * don't change its value; evaluated at most once, on first use.
+ */
+class Thunk : public Expression {
+    std::shared_ptr<Expression> expr;
+    Bindings captured;
+    // copies of the slots of the function the thunk was created in
+    Captured frame_captured;
+    std::shared_ptr<Box> frame_argument;
+    std::shared_ptr<Expression> value;
+public:
+
+    Thunk(std::shared_ptr<Expression> expr, Bindings captured,
+          Captured frame_captured, std::shared_ptr<Box> frame_argument);
+
+    ~Thunk() override = default;
+
+    std::shared_ptr<Expression> eval(Env &env) override;
+
+    /**
+     * @return the value of the expression, evaluating it on first call
+     */
+    std::shared_ptr<Expression> force(Env &env);
+
+    /**
+     * The captured boxes, by name and by slot, emptied by forcing, and
+     * the value, nullptr until then.
+     */
+    const Bindings& getCaptured() const;
+
+    const Captured& getFrameCaptured() const;
+
+    const std::shared_ptr<Box>& getFrameArgument() const;
+
+    const std::shared_ptr<Expression>& getValue() const;
 
     int get_value() const override;
 
@@ -199,20 +445,29 @@ public:
 
 class Set : public Expression {
     std::string id;
+    int slot;
     std::shared_ptr<Expression> e_val;
 public:
 
     Set(std::string id, std::shared_ptr<Expression> expr);
 
-    ~Set() override = default;
+    ~Set() override;
 
     std::string get_id () const override;
 
-    std::shared_ptr<Expression> eval() override;
+    std::shared_ptr<Expression> eval(Env &env) override;
 
     int get_value () const override;
 
     std::string to_string() const override;
+
+    size_t child_count() const override;
+
+    std::shared_ptr<Expression>& child(size_t index) override;
+
+    void note_free_vars(FreeVars &free) override;
+
+    void note_slots(const SlotScope &scope) override;
 };
 
 class Block : public Expression {
@@ -221,24 +476,153 @@ public:
 
     explicit Block(std::vector<std::shared_ptr<Expression>> expr_array);
 
-    ~Block() override = default;
+    ~Block() override;
 
-    std::shared_ptr<Expression> eval() override;
+    std::shared_ptr<Expression> eval(Env &env) override;
 
     int get_value () const override;
 
     std::string get_id () const override;
 
     std::string to_string() const override;
+
+    size_t child_count() const override;
+
+    std::shared_ptr<Expression>& child(size_t index) override;
+};
+
+/**
+ * Storage of one variable binding. Shared by the scope that created it
+ * and every closure that captured it, so 'set' is seen by all of them.
+ */
+struct Box {
+    std::shared_ptr<Expression> value;
+
+    explicit Box(std::shared_ptr<Expression> value) :
+        value(std::move(value))
+    {}
 };
 
 struct Env {
-    std::unordered_map<std::string, std::unordered_map<std::string,
-            std::shared_ptr<Expression>>> envMap;
+    Bindings currentEnv;
+
+    // slots of the function being applied, nullptr outside functions;
+    // set by Function::apply() and Thunk::force()
+    const Captured *captured = nullptr;
+    const std::shared_ptr<Box> *argument = nullptr;
+
+    // call-by-need for 'let' values and call arguments
+    bool lazy = false;
+    size_t thunks_created = 0;
+    size_t thunks_forced = 0;
 
-    std::unordered_map<std::string,std::shared_ptr<Expression>> currentEnv;
+    // lowest native stack address evaluation may reach, 0 for no limit;
+    // set by Interpreter::evaluate()
+    uintptr_t stack_limit = 0;
 
-    std::shared_ptr<Expression> fromEnv(const std::string &V);
+    // boxes given a value that can refer to boxes, the only ones that
+    // can be part of a reference cycle; see release_cycles()
+    std::vector<std::weak_ptr<Box>> tracked;
+    size_t prune_at = 64;
+
+    /**
+     * Called on entry by every eval() that evaluates subexpressions, as
+     * evaluation nests on the native stack.
+     *
+     * @throws depth_error if the stack is down to stack_limit
+     */
+    void check_depth() const {
+        char here;
+
+        if (reinterpret_cast<uintptr_t>(&here) < stack_limit) {
+            throw depth_error();
+        }
+    }
+
+    /**
+     * Returns the value of V, forcing it first if it is a thunk. V is
+     * read from 'slot' if the running function holds it there.
+     *
+     * @throws std::out_of_range if V is unbound
+     */
+    std::shared_ptr<Expression> fromEnv(const std::string &V,
+                                        int slot = VarRef::by_name);
+
+    /**
+     * Same as fromEnv() without copying the pointer; valid until the
+     * next change to the bindings.
+     */
+    const std::shared_ptr<Expression>& lookup(const std::string &V,
+                                              int slot = VarRef::by_name);
+
+    /**
+     * @return the box V is bound to, nullptr if it is unbound
+     */
+    const std::shared_ptr<Box>* find(const std::string &V, int slot);
+
+    /**
+     * @return the box held in 'slot' by the running function, nullptr
+     *         if there is none
+     */
+    const std::shared_ptr<Box>* frame_slot(int slot) const {
+        if (slot == VarRef::argument) {
+            return argument != nullptr && *argument != nullptr ?
+                   argument : nullptr;
+        }
+
+        if (slot > 0 && captured != nullptr &&
+            static_cast<size_t>(slot) <= captured->size() &&
+            (*captured)[slot - 1] != nullptr) {
+            return &(*captured)[slot - 1];
+        }
+
+        return nullptr;
+    }
+
+    /**
+     * Wraps 'expr' in a thunk holding copies of the bindings of 'refs'.
+     */
+    std::shared_ptr<Expression> delay(std::shared_ptr<Expression> expr,
+                                      const std::vector<VarRef> &refs);
+
+    /**
+     * Makes V refer to 'box' and returns the binding it shadows,
+     * nullptr if V was unbound.
+     */
+    std::shared_ptr<Box> bind(const std::string &V, std::shared_ptr<Box> box);
+
+    /**
+     * Undoes bind(): puts back the 'shadowed' binding of V.
+     */
+    void restore(const std::string &V, std::shared_ptr<Box> shadowed);
+
+    /**
+     * Tracks 'box' if its value is a closure, thunk or set result.
+     */
+    void track(const std::shared_ptr<Box> &box);
+
+    /**
+     * Ends an evaluation: empties the tracked boxes that 'result' does
+     * not reach, so closures that captured each other's boxes are freed.
+     * 'result' is nullptr when the evaluation failed.
+     */
+    void release_cycles(const std::shared_ptr<Expression> &result);
 };
 
-#endif // __EXPRESSIONS_H__
\ No newline at end of file
+/**
+ * @return true if evaluating 'expr', whose free variables are 'free',
+ *         can be deferred in lazy mode: it has no side effects and is
+ *         not cheaper than a thunk
+ */
+bool deferrable(Expression &expr, const FreeVars &free);
+
+/**
+ * Computes the free variables of every Function in 'program' and
+ * stores them as its captures, then gives every variable reference in
+ * a function body its slot. Must run once before the first eval().
+ *
+ * @return the free variables of 'program' itself
+ */
+std::set<std::string> resolve_captures(Expression &program);
+
+#endif // __EXPRESSIONS_H__
@@ -0,0 +1,164 @@
+#include "interpreter.h"
+#include "parser.h"
+
+#include <algorithm>
+#include <pthread.h>
+#include <sstream>
+
+////////////// Program /////////////////
+
+Program::Program(std::shared_ptr<Expression> root,
+                 std::set<std::string> free_vars,
+                 std::vector<std::pair<std::string, size_t>> specializations) :
+    root(std::move(root)),
+    free_vars(std::move(free_vars)),
+    specializations(std::move(specializations))
+{}
+
+const std::shared_ptr<Expression>& Program::getRoot() const {
+    return root;
+}
+
+const std::set<std::string>& Program::getFreeVars() const {
+    return free_vars;
+}
+
+const std::vector<std::pair<std::string, size_t>>&
+        Program::getSpecializations() const {
+    return specializations;
+}
+
+////////////// Interpreter /////////////////
+
+/**
+ * Lowest address evaluation on this thread may use, leaving room for
+ * unwinding and reporting the depth_error; 0 if it can't be found.
+ */
+static uintptr_t stack_limit() {
+    thread_local uintptr_t limit = [] {
+        pthread_attr_t attributes;
+        void *low;
+        size_t size;
+
+        if (pthread_getattr_np(pthread_self(), &attributes) != 0) {
+            return uintptr_t(0);
+        }
+
+        int failed = pthread_attr_getstack(&attributes, &low, &size);
+        pthread_attr_destroy(&attributes);
+
+        if (failed != 0) {
+            return uintptr_t(0);
+        }
+
+        return reinterpret_cast<uintptr_t>(low) +
+                std::min<size_t>(size / 4, 256 << 10);
+    }();
+
+    return limit;
+}
+
+std::vector<SpecializationPattern>& Interpreter::getPatterns() {
+    if (!patterns) {
+        patterns = default_patterns();
+    }
+
+    return *patterns;
+}
+
+ProgramHandle Interpreter::prepare(const std::string &source) const {
+    std::istringstream input(source);
+    return prepare(input);
+}
+
+ProgramHandle Interpreter::prepare(std::istream &input) const {
+    MemoryAccounting::Scope scope(memory.get());
+    Parser parser;
+    std::shared_ptr<Expression> root = parser.read_and_create(input);
+    const std::vector<SpecializationPattern> &active =
+            patterns ? *patterns : default_patterns();
+    std::vector<size_t> hits = specialize(root, active);
+    std::set<std::string> free_vars = resolve_captures(*root);
+    std::vector<std::pair<std::string, size_t>> specializations;
+
+    for (size_t i = 0; i < active.size(); i++) {
+        specializations.emplace_back(active[i].name, hits[i]);
+    }
+
+    return std::make_shared<const Program>(std::move(root),
+            std::move(free_vars), std::move(specializations));
+}
+
+std::shared_ptr<Expression> Interpreter::evaluate(const ProgramHandle &program,
+        const std::unordered_map<std::string, int> &bindings) {
+    MemoryAccounting::Scope scope(memory.get());
+    // clear() keeps the buckets, repeated evaluations don't rehash
+    env.currentEnv.clear();
+    // left set if the last evaluation threw inside a function
+    env.captured = nullptr;
+    env.argument = nullptr;
+
+    // unless accounting was switched since the last evaluation
+    if (env.currentEnv.get_allocator() != Bindings::allocator_type()) {
+        env.currentEnv = Bindings();
+    }
+
+    if (memory) {
+        memory->setBudget(memory_budget);
+    }
+
+    env.stack_limit = stack_limit();
+
+    std::shared_ptr<Expression> result;
+
+    try {
+        for (const auto& [name, value] : bindings) {
+            env.currentEnv.insert({name, make_counted<Box, env_storage>(
+                    make_counted<Val, runtime_values>(value))});
+        }
+
+        result = program->getRoot()->eval(env);
+    } catch (...) {
+        env.currentEnv.clear();
+        env.release_cycles(nullptr);
+        throw;
+    }
+
+    env.currentEnv.clear();
+    env.release_cycles(result);
+    return result;
+}
+
+void Interpreter::setLazy(bool lazy) {
+    env.lazy = lazy;
+}
+
+size_t Interpreter::getThunksCreated() const {
+    return env.thunks_created;
+}
+
+size_t Interpreter::getThunksForced() const {
+    return env.thunks_forced;
+}
+
+void Interpreter::setMemoryAccounting(bool enabled) {
+    if (!enabled) {
+        memory.reset();
+    }
+    else if (!memory) {
+        memory = MemoryAccounting::create();
+    }
+}
+
+void Interpreter::setMemoryBudget(size_t bytes) {
+    setMemoryAccounting(true);
+    memory_budget = bytes;
+}
+
+MemoryStats Interpreter::getMemoryStats(memoryCategory category) const {
+    if (!memory) {
+        return {0, 0, 0, 0};
+    }
+
+    return memory->getStats(category);
+}
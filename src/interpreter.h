@@ -0,0 +1,126 @@
+#ifndef __INTERPRETER_H__
+#define __INTERPRETER_H__
+
+#include <iostream>
+#include <memory>
+#include <optional>
+#include <set>
+#include <string>
+#include <unordered_map>
+#include <utility>
+#include <vector>
+#include "expressions.h"
+#include "specialize.h"
+
+/**
+ * Parsed and analysed program. Never modified after prepare(), so one
+ * Program may be evaluated by any number of interpreters and threads.
+ */
+class Program {
+    std::shared_ptr<Expression> root;
+    std::set<std::string> free_vars;
+    std::vector<std::pair<std::string, size_t>> specializations;
+public:
+
+    Program(std::shared_ptr<Expression> root,
+            std::set<std::string> free_vars,
+            std::vector<std::pair<std::string, size_t>> specializations);
+
+    const std::shared_ptr<Expression>& getRoot() const;
+
+    /**
+     * @return the variables the program uses without binding them,
+     *         i.e. those the host is expected to supply
+     */
+    const std::set<std::string>& getFreeVars() const;
+
+    /**
+     * @return every specialization pattern with the number of nodes
+     *         it rewrote in this program
+     */
+    const std::vector<std::pair<std::string, size_t>>&
+            getSpecializations() const;
+};
+
+using ProgramHandle = std::shared_ptr<const Program>;
+
+/**
+ * Entry point for embedding DL. An Interpreter owns all evaluation
+ * state, so separate instances are independent of each other; one
+ * instance evaluates one program at a time.
+ */
+class Interpreter {
+    Env env;
+    // a copy of default_patterns() once getPatterns() was called
+    std::optional<std::vector<SpecializationPattern>> patterns;
+    std::unique_ptr<MemoryAccounting, MemoryAccounting::Disown> memory;
+    size_t memory_budget = 0;
+public:
+
+    Interpreter() = default;
+    ~Interpreter() = default;
+
+    /**
+     * Patterns prepare() uses to rewrite programs into fused
+     * expressions; may be extended, or cleared to keep programs as
+     * parsed.
+     */
+    std::vector<SpecializationPattern>& getPatterns();
+
+    /**
+     * Parses and analyses a program once for repeated evaluation.
+     *
+     * @throws parse_error if the source is not a valid program
+     */
+    ProgramHandle prepare(const std::string &source) const;
+
+    ProgramHandle prepare(std::istream &input) const;
+
+    /**
+     * Evaluates a prepared program with 'bindings' as the initial
+     * values of its free variables. Closures that captured each other
+     * are freed when it returns, unless the result refers to them.
+     *
+     * @return the value of the program, a Val or a function
+     *
+     * @throws eval_error, getValue_error or std::out_of_range as
+     *         Expression::eval does
+     * @throws memory_error if the evaluation goes over the memory budget
+     */
+    std::shared_ptr<Expression> evaluate(const ProgramHandle &program,
+            const std::unordered_map<std::string, int> &bindings = {});
+
+    /**
+     * Switches to call-by-need: side-effect free 'let' values and call
+     * arguments are evaluated on first use instead of up front.
+     */
+    void setLazy(bool lazy);
+
+    /**
+     * Thunk counters over all evaluations of this interpreter.
+     */
+    size_t getThunksCreated() const;
+
+    size_t getThunksForced() const;
+
+    /**
+     * Counts the allocations of programs prepared and evaluated from now
+     * on, see getMemoryStats(). Turning it off drops the counters.
+     */
+    void setMemoryAccounting(bool enabled);
+
+    /**
+     * Makes evaluate() throw memory_error once the runtime values and
+     * env storage it holds take more than 'bytes'; 0 for no limit.
+     * Turns memory accounting on.
+     */
+    void setMemoryBudget(size_t bytes);
+
+    /**
+     * @return the counters of 'category', all zero while accounting is
+     *         off
+     */
+    MemoryStats getMemoryStats(memoryCategory category) const;
+};
+
+#endif // __INTERPRETER_H__
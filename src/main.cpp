@@ -1,15 +1,153 @@
-#include "parser.h"
+#include "emit_cpp.h"
+#include "interpreter.h"
+#include "server.h"
+#include <cstring>
 #include <memory>
+#include <thread>
+#include <unistd.h>
+
+static int usage() {
+    std::cerr << "usage: DL_interpreter [--lazy] [--lazy-stats]"
+                 " [--no-specialize] [--specialize-stats]\n"
+                 "                      [--mem-stats] [--mem-budget <bytes>]\n"
+                 "       DL_interpreter --emit-cpp\n"
+                 "       DL_interpreter [--serve <socket> | --serve-stdio]"
+                 " [--threads <n>] [--cache-size <n>]" << std::endl;
+    return 2;
+}
+
+int main(int argc, char* argv[]) {
+    std::string socket_path;
+    bool serve_stdio = false;
+    bool lazy = false;
+    bool lazy_stats = false;
+    bool specialize = true;
+    bool specialize_stats = false;
+    bool emit = false;
+    bool mem_stats = false;
+    size_t mem_budget = 0;
+    size_t threads = std::max(1u, std::thread::hardware_concurrency());
+    size_t cache_size = 256;
+
+    try {
+        for (int i = 1; i < argc; i++) {
+            bool has_value = i + 1 < argc;
+
+            if (!strcmp(argv[i], "--serve") && has_value) {
+                socket_path = argv[++i];
+            }
+            else if (!strcmp(argv[i], "--serve-stdio")) {
+                serve_stdio = true;
+            }
+            else if (!strcmp(argv[i], "--lazy")) {
+                lazy = true;
+            }
+            else if (!strcmp(argv[i], "--lazy-stats")) {
+                lazy = lazy_stats = true;
+            }
+            else if (!strcmp(argv[i], "--no-specialize")) {
+                specialize = false;
+            }
+            else if (!strcmp(argv[i], "--specialize-stats")) {
+                specialize_stats = true;
+            }
+            else if (!strcmp(argv[i], "--emit-cpp")) {
+                emit = true;
+            }
+            else if (!strcmp(argv[i], "--mem-stats")) {
+                mem_stats = true;
+            }
+            else if (!strcmp(argv[i], "--mem-budget") && has_value) {
+                mem_budget = std::stoul(argv[++i]);
+            }
+            else if (!strcmp(argv[i], "--threads") && has_value) {
+                threads = std::stoul(argv[++i]);
+            }
+            else if (!strcmp(argv[i], "--cache-size") && has_value) {
+                cache_size = std::stoul(argv[++i]);
+            }
+            else {
+                return usage();
+            }
+        }
+    } catch (std::exception&) {
+        return usage();
+    }
+
+    if (serve_stdio || !socket_path.empty()) {
+        try {
+            Server server(threads, cache_size);
+
+            if (serve_stdio) {
+                server.serve_connection(STDIN_FILENO, STDOUT_FILENO);
+            }
+            else {
+                server.serve_socket(socket_path);
+            }
+        } catch (std::exception& Exception) {
+            std::cerr << "ERROR: " << Exception.what() << std::endl;
+            return 1;
+        }
+        return 0;
+    }
+
+    Interpreter interpreter;
+
+    // errors go to stderr, stdout is the generated file
+    if (emit) {
+        try {
+            // the translation works on the plain expression classes
+            interpreter.getPatterns().clear();
+            std::cout << emit_cpp(*interpreter.prepare(std::cin)->getRoot());
+        } catch (std::exception& Exception) {
+            std::cerr << "ERROR: " << Exception.what() << std::endl;
+            return 1;
+        }
+        return 0;
+    }
+
+    interpreter.setLazy(lazy);
+    interpreter.setMemoryAccounting(mem_stats);
+
+    if (mem_budget != 0) {
+        interpreter.setMemoryBudget(mem_budget);
+    }
 
-int main() {
     try {
-        Parser parser;
-        std::shared_ptr<Expression> Expr = parser.read_and_create(std::cin);
-        std::shared_ptr<Expression> Eval = Expr->eval();
+        if (!specialize) {
+            interpreter.getPatterns().clear();
+        }
+
+        ProgramHandle program = interpreter.prepare(std::cin);
+        std::shared_ptr<Expression> Eval = interpreter.evaluate(program);
         std::cout << Eval->to_string() << std::endl;
+
+        if (lazy_stats) {
+            std::cerr << "thunks created: " << interpreter.getThunksCreated()
+                      << ", forced: " << interpreter.getThunksForced()
+                      << std::endl;
+        }
+
+        if (specialize_stats) {
+            for (const auto& [pattern, hits] : program->getSpecializations()) {
+                std::cerr << pattern << ": " << hits << std::endl;
+            }
+        }
     } catch (std::exception& Exception) {
         std::cout << "ERROR: ";
         std::cout << Exception.what() << std::endl;
     }
+
+    // after an error as well, to see how far the budget got
+    if (mem_stats) {
+        for (size_t i = 0; i < memory_categories; i++) {
+            auto category = memoryCategory(i);
+            MemoryStats stats = interpreter.getMemoryStats(category);
+            std::cerr << MemoryAccounting::category_name(category)
+                      << ": live " << stats.live_bytes << " B in "
+                      << stats.live_count << ", peak " << stats.peak_bytes
+                      << " B, allocations " << stats.allocations << std::endl;
+        }
+    }
     return 0;
-}
\ No newline at end of file
+}
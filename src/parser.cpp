@@ -1,127 +1,230 @@
 #include "parser.h"
 #include "errors.h"
 
-void Parser::get_clean_string(std::string &str, std::istream &input) {
+#include <cctype>
+
+Parser::tokenType Parser::next_token(std::string &str, std::istream &input) {
+    std::streambuf *buf = input.rdbuf();
+    int c = buf->sgetc();
+
+    while (c != EOF && std::isspace(c)) {
+        c = buf->snextc();
+    }
+
+    if (c == EOF) {
+        input.setstate(std::ios::eofbit);
+        return end_of_input;
+    }
+
+    if (c == '(' || c == ')') {
+        buf->sbumpc();
+        return c == '(' ? open_paren : close_paren;
+    }
+
+    str.clear();
+    while (c != EOF && !std::isspace(c) && c != '(' && c != ')') {
+        str += static_cast<char>(c);
+        c = buf->snextc();
+    }
+
+    return word;
+}
+
+void Parser::read_word(std::string &str, std::istream &input) {
+    tokenType token = next_token(str, input);
+
+    while (token == open_paren) {
+        depth++;
+        token = next_token(str, input);
+    }
+
+    if (token != word) {
+        throw parse_error();
+    }
+}
+
+void Parser::expect_word(const char *expected, std::istream &input) {
     std::string temp;
-    input >> temp;
-
-    int balance = 0;
-    for (const char& c : temp) {
-        if (c == '(') {
-            balance++;
-        } 
-        else if (c == ')') {
-            balance--;
-        } 
-        else {
-            str += c;
+    tokenType token = next_token(temp, input);
+
+    while (token == open_paren || token == close_paren) {
+        depth += token == open_paren ? 1 : -1;
+
+        if (!block_depths.empty() && depth < block_depths.back()) {
+            throw parse_error();
         }
+
+        token = next_token(temp, input);
+    }
+
+    if (token != word || temp != expected) {
+        throw parse_error();
+    }
+}
+
+bool Parser::open_frame(std::vector<Frame> &stack, const std::string &keyword,
+                        std::istream &input) {
+    Frame frame;
+
+    if (keyword == "add") {
+        frame.type = add;
+    }
+    else if (keyword == "if") {
+        frame.type = _if;
     }
-    
-    if (str.empty() && balance > 0) {
-        get_clean_string(str, input);
+    else if (keyword == "let") {
+        frame.type = let;
+        read_word(frame.id, input);
+        expect_word("=", input);
+    }
+    else if (keyword == "function") {
+        frame.type = function;
+        read_word(frame.id, input);
+    }
+    else if (keyword == "call") {
+        frame.type = call;
+    }
+    else if (keyword == "set") {
+        frame.type = set;
+        read_word(frame.id, input);
+    }
+    else if (keyword == "block") {
+        frame.type = block;
+        block_depths.push_back(depth);
+    }
+    else {
+        return false;
+    }
+
+    stack.push_back(std::move(frame));
+    return true;
+}
+
+void Parser::read_separator(const Frame &frame, std::istream &input) {
+    if (frame.type == _if && frame.operands.size() == 2) {
+        expect_word("then", input);
+    }
+    else if (frame.type == _if && frame.operands.size() == 3) {
+        expect_word("else", input);
+    }
+    else if (frame.type == let && frame.operands.size() == 1) {
+        expect_word("in", input);
+    }
+}
+
+std::shared_ptr<Expression> Parser::build(Frame &frame) {
+    std::vector<std::shared_ptr<Expression>> &op = frame.operands;
+
+    switch (frame.type) {
+        case add:
+            return make_counted<Add, ast_nodes>(op[0], op[1]);
+        case _if:
+            return make_counted<If, ast_nodes>(op[0], op[1], op[2], op[3]);
+        case let:
+            return make_counted<Let, ast_nodes>(frame.id, op[0], op[1]);
+        case function:
+            return make_counted<Function, ast_nodes>(frame.id, op[0]);
+        case call:
+            return make_counted<Call, ast_nodes>(op[0], op[1]);
+        case set:
+            return make_counted<Set, ast_nodes>(frame.id, op[0]);
+        case block:
+            block_depths.pop_back();
+
+            if (op.empty()) {
+                throw parse_error();
+            }
+
+            return make_counted<Block, ast_nodes>(std::move(op));
+        default:
+            throw parse_error();
+    }
+}
+
+static size_t arity(typeInHash type) {
+    switch (type) {
+        case _if:
+            return 4;
+        case add: case let: case call:
+            return 2;
+        case function: case set:
+            return 1;
+        default:
+            return 0;
     }
 }
 
 std::shared_ptr<Expression> Parser::read_and_create(std::istream& input) {
+    std::vector<Frame> stack;
     std::string current;
-    get_clean_string(current, input);
-
-    if (current == "val") {
-        std::string integer;
-        get_clean_string(integer, input);
-        return std::make_shared<Val>(std::stoi(integer));
-    } 
-    
-    if (current == "var") {
-        std::string name;
-        get_clean_string(name, input);
-        return std::make_shared<Var>(name);
-    } 
-    
-    if (current == "add") {
-        return std::make_shared<Add>(read_and_create(input),
-                                        read_and_create(input));
-    } 
-    
-    if (current == "if") {
-        std::shared_ptr<Expression> if_left = read_and_create(input);
-        std::shared_ptr<Expression> if_right = read_and_create(input);
-        std::string temp;
-        input >> temp;
-
-        if (temp != "then") {
-            throw parse_error();
-        }
-        
-        std::shared_ptr<Expression> if_then = read_and_create(input);
-        input >> temp;
-        
-        if (temp != "else") {
-            throw parse_error();
+    depth = 0;
+    block_depths.clear();
+
+    while (true) {
+        std::shared_ptr<Expression> result;
+        tokenType token = next_token(current, input);
+
+        if (token == open_paren) {
+            depth++;
+            continue;
         }
-        
-        std::shared_ptr<Expression> if_else = read_and_create(input);
-        return std::make_shared<If>(if_left, if_right, if_then, if_else);
-    }
-    
-    if (current == "let") {
-        std::string name;
-        input >> name;
-        std::string temp;
-        input >> temp;
-
-        if (temp != "=") {
-            throw parse_error();
+
+        if (token == close_paren) {
+            depth--;
+
+            // any ')' not closing the innermost block is only decoration
+            if (block_depths.empty() || depth >= block_depths.back()) {
+                continue;
+            }
+
+            if (stack.back().type != block) {
+                throw parse_error();
+            }
+
+            result = build(stack.back());
+            stack.pop_back();
         }
+        else if (token == end_of_input) {
+            if (stack.empty() || stack.back().type != block) {
+                throw parse_error();
+            }
 
-        std::shared_ptr<Expression> id_expr = read_and_create(input);
-        input >> temp;
-        
-        if (temp != "in") {
+            result = build(stack.back());
+            stack.pop_back();
+        }
+        else if (current == "val") {
+            std::string integer;
+            read_word(integer, input);
+            result = make_counted<Val, ast_nodes>(std::stoi(integer));
+        }
+        else if (current == "var") {
+            std::string name;
+            read_word(name, input);
+            result = make_counted<Var, ast_nodes>(name);
+        }
+        else if (open_frame(stack, current, input)) {
+            continue;
+        }
+        else {
             throw parse_error();
         }
 
-        std::shared_ptr<Expression> in_expr = read_and_create(input);
-        return std::make_shared<Let>(name, id_expr, in_expr);
-    }
-    
-    if (current == "function") {
-        std::string id_name;
-        input >> id_name;
-        return std::make_shared<Function>(id_name, read_and_create(input));
-    }
-    
-    if (current == "call") {
-        std::shared_ptr<Expression> func = read_and_create(input);
-        std::shared_ptr<Expression> arg = read_and_create(input);
-        return std::make_shared<Call>(func, arg);
-    }
-    
-    if (current == "set") {
-        std::string name;
-        get_clean_string(name, input);
-        return std::make_shared<Set>(name, read_and_create(input));
-    }
-    
-    if (current == "block") {
-        int block_balance = balance;
-        std::vector<std::shared_ptr<Expression>> expr_array;
-
-        while (balance != block_balance - 1) {
-            try {
-                expr_array.insert(expr_array.end(), read_and_create(input));
-            } 
-            catch (parse_error&) {
-                if (balance == 0) {
-                    return std::make_shared<Block>(expr_array);
-                } 
-                throw parse_error();
+        // hands the finished expression to the frames waiting for it
+        while (!stack.empty()) {
+            Frame &top = stack.back();
+            top.operands.push_back(std::move(result));
+
+            if (top.type == block || top.operands.size() < arity(top.type)) {
+                read_separator(top, input);
+                break;
             }
+
+            result = build(top);
+            stack.pop_back();
         }
 
-        return std::make_shared<Block>(expr_array);
+        if (stack.empty()) {
+            return result;
+        }
     }
-
-    throw parse_error();
-}
\ No newline at end of file
+}
@@ -4,21 +4,50 @@
 #include <iostream>
 #include <string>
 #include <memory>
+#include <vector>
 #include "expressions.h"
 
 class Parser {
 
-    void get_clean_string(std::string &str, std::istream &input);
+    enum tokenType {word, open_paren, close_paren, end_of_input};
 
-    int balance;
+    /**
+     * Partially built compound expression waiting for its operands.
+     * Operands are collected left to right.
+     */
+    struct Frame {
+        typeInHash type;
+        std::string id;
+        std::vector<std::shared_ptr<Expression>> operands;
+    };
+
+    tokenType next_token(std::string &str, std::istream &input);
+
+    void read_word(std::string &str, std::istream &input);
+
+    void expect_word(const char *expected, std::istream &input);
+
+    bool open_frame(std::vector<Frame> &stack, const std::string &keyword,
+                    std::istream &input);
+
+    void read_separator(const Frame &frame, std::istream &input);
+
+    std::shared_ptr<Expression> build(Frame &frame);
+
+    // parenthesis depth, 'block' ends on the ')' that drops below its entry
+    int depth;
+
+    std::vector<int> block_depths;
 
 public:
 
-    Parser() : balance(0) {}
+    Parser() : depth(0) {}
     ~Parser() = default;
 
     /**
      * Reads and creates an expression from the given input stream.
+     * Uses an explicit stack instead of recursion, so nesting depth
+     * is limited only by available memory.
      *
      * @param input the input stream to read from
      *
@@ -30,4 +59,4 @@ public:
 
 };
 
-#endif // __PARSER_H__
\ No newline at end of file
+#endif // __PARSER_H__
@@ -0,0 +1,448 @@
+#include "server.h"
+
+#include <algorithm>
+#include <cerrno>
+#include <csignal>
+#include <cstdio>
+#include <future>
+#include <sstream>
+#include <system_error>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <unistd.h>
+
+////////////// ThreadPool /////////////////
+
+ThreadPool::ThreadPool(size_t threads) :
+    stopping(false)
+{
+    for (size_t i = 0; i < std::max<size_t>(threads, 1); i++) {
+        workers.emplace_back(&ThreadPool::work, this);
+    }
+}
+
+ThreadPool::~ThreadPool() {
+    {
+        std::lock_guard<std::mutex> lock(mutex);
+        stopping = true;
+    }
+
+    ready.notify_all();
+
+    for (auto& worker : workers) {
+        worker.join();
+    }
+}
+
+void ThreadPool::submit(std::function<void()> task) {
+    {
+        std::lock_guard<std::mutex> lock(mutex);
+        tasks.push(std::move(task));
+    }
+
+    ready.notify_one();
+}
+
+void ThreadPool::work() {
+    while (true) {
+        std::function<void()> task;
+        {
+            std::unique_lock<std::mutex> lock(mutex);
+            ready.wait(lock, [this] { return stopping || !tasks.empty(); });
+
+            if (tasks.empty()) {
+                return;
+            }
+
+            task = std::move(tasks.front());
+            tasks.pop();
+        }
+        task();
+    }
+}
+
+////////////// ProgramCache /////////////////
+
+ProgramCache::ProgramCache(size_t capacity) :
+    capacity(capacity)
+{}
+
+uint64_t ProgramCache::hash(const std::string &source) {
+    // 64-bit FNV-1a
+    uint64_t result = 14695981039346656037ull;
+
+    for (const char& c : source) {
+        result = (result ^ static_cast<unsigned char>(c)) * 1099511628211ull;
+    }
+
+    return result;
+}
+
+ProgramHandle ProgramCache::find(uint64_t hash, const std::string &source) {
+    std::lock_guard<std::mutex> lock(mutex);
+    auto found = index.find(hash);
+
+    if (found == index.end() || found->second->source != source) {
+        return nullptr;
+    }
+
+    entries.splice(entries.begin(), entries, found->second);
+    return found->second->program;
+}
+
+void ProgramCache::insert(uint64_t hash, const std::string &source,
+                          ProgramHandle program) {
+    if (capacity == 0) {
+        return;
+    }
+
+    std::lock_guard<std::mutex> lock(mutex);
+    auto found = index.find(hash);
+
+    if (found != index.end()) {
+        entries.erase(found->second);
+        index.erase(found);
+    }
+
+    entries.push_front({hash, source, std::move(program)});
+    index.insert({hash, entries.begin()});
+
+    if (entries.size() > capacity) {
+        index.erase(entries.back().hash);
+        entries.pop_back();
+    }
+}
+
+////////////// ServerStats /////////////////
+
+ServerStats::ServerStats() :
+    next_sample(0),
+    requests(0),
+    errors(0),
+    cache_hits(0),
+    cache_misses(0),
+    start(std::chrono::steady_clock::now())
+{}
+
+void ServerStats::record(double seconds, bool cache_hit, bool error) {
+    std::lock_guard<std::mutex> lock(mutex);
+
+    if (latencies.size() < window) {
+        latencies.push_back(seconds);
+    }
+    else {
+        latencies[next_sample] = seconds;
+        next_sample = (next_sample + 1) % window;
+    }
+
+    requests++;
+    errors += error;
+    cache_hits += cache_hit;
+    cache_misses += !cache_hit;
+}
+
+static double percentile(std::vector<double> &samples, double p) {
+    if (samples.empty()) {
+        return 0;
+    }
+
+    auto nth = samples.begin() + static_cast<size_t>(p * (samples.size() - 1));
+    std::nth_element(samples.begin(), nth, samples.end());
+    return *nth;
+}
+
+std::string ServerStats::report() {
+    std::vector<double> samples;
+    std::ostringstream out;
+    std::lock_guard<std::mutex> lock(mutex);
+    samples = latencies;
+
+    std::chrono::duration<double> uptime =
+            std::chrono::steady_clock::now() - start;
+    uint64_t lookups = cache_hits + cache_misses;
+
+    out << "requests " << requests << "\n";
+    out << "errors " << errors << "\n";
+    out << "throughput_rps " << requests / uptime.count() << "\n";
+    out << "cache_hit_rate "
+        << (lookups == 0 ? 0.0 : double(cache_hits) / lookups) << "\n";
+    out << "latency_p50_us " << percentile(samples, 0.50) * 1e6 << "\n";
+    out << "latency_p99_us " << percentile(samples, 0.99) * 1e6;
+    return out.str();
+}
+
+////////////// Server /////////////////
+
+Server::Server(size_t threads, size_t cache_size) :
+    pool(threads),
+    cache(cache_size)
+{}
+
+static std::string response(const char *status, const std::string &payload) {
+    return std::string(status) + " " + std::to_string(payload.size()) + "\n" +
+            payload + "\n";
+}
+
+std::string Server::evaluate(const std::string &source,
+                             std::chrono::steady_clock::time_point received) {
+    uint64_t key = ProgramCache::hash(source);
+    ProgramHandle program = cache.find(key, source);
+    bool hit = program != nullptr;
+    std::string result;
+    bool failed = false;
+
+    try {
+        Interpreter interpreter;
+
+        if (!hit) {
+            program = interpreter.prepare(source);
+            cache.insert(key, source, program);
+        }
+
+        result = response("ok", interpreter.evaluate(program)->to_string());
+    } catch (std::exception& Exception) {
+        result = response("error", Exception.what());
+        failed = true;
+    }
+
+    std::chrono::duration<double> latency =
+            std::chrono::steady_clock::now() - received;
+    stats.record(latency.count(), hit, failed);
+    return result;
+}
+
+/**
+ * Buffered reads of lines and fixed-size payloads from a descriptor.
+ */
+class FdReader {
+    int fd;
+    std::string buffer;
+    size_t pos;
+
+    bool fill() {
+        char chunk[1 << 16];
+        ssize_t n;
+
+        do {
+            n = read(fd, chunk, sizeof chunk);
+        } while (n < 0 && errno == EINTR);
+
+        if (n <= 0) {
+            return false;
+        }
+
+        buffer.erase(0, pos);
+        pos = 0;
+        buffer.append(chunk, n);
+        return true;
+    }
+
+public:
+
+    explicit FdReader(int fd) : fd(fd), pos(0) {}
+
+    // a line longer than 'max' bytes reads as an empty one
+    bool read_line(std::string &line, size_t max) {
+        size_t end;
+
+        while ((end = buffer.find('\n', pos)) == std::string::npos) {
+            if (buffer.size() - pos > max) {
+                line.clear();
+                return true;
+            }
+
+            if (!fill()) {
+                return false;
+            }
+        }
+
+        if (end - pos > max) {
+            line.clear();
+            return true;
+        }
+
+        line.assign(buffer, pos, end - pos);
+        pos = end + 1;
+        return true;
+    }
+
+    bool read_bytes(std::string &bytes, size_t count) {
+        while (buffer.size() - pos < count) {
+            if (!fill()) {
+                return false;
+            }
+        }
+
+        bytes.assign(buffer, pos, count);
+        pos += count;
+        return true;
+    }
+};
+
+static bool write_all(int fd, const std::string &data) {
+    size_t written = 0;
+
+    while (written < data.size()) {
+        ssize_t n = write(fd, data.data() + written, data.size() - written);
+
+        if (n < 0 && errno == EINTR) {
+            continue;
+        }
+
+        if (n <= 0) {
+            return false;
+        }
+
+        written += n;
+    }
+
+    return true;
+}
+
+void Server::serve_connection(int in_fd, int out_fd) {
+    std::queue<std::future<std::string>> pending;
+    std::mutex mutex;
+    std::condition_variable ready;
+    bool finished = false;
+    bool closed = false;
+
+    // responses go out in request order while later requests still run
+    std::thread writer([&] {
+        while (true) {
+            std::future<std::string> next;
+            {
+                std::unique_lock<std::mutex> lock(mutex);
+                ready.wait(lock, [&] { return finished || !pending.empty(); });
+
+                if (pending.empty()) {
+                    return;
+                }
+
+                next = std::move(pending.front());
+                pending.pop();
+            }
+
+            if (!write_all(out_fd, next.get())) {
+                std::lock_guard<std::mutex> lock(mutex);
+                closed = true;
+                // wakes the reader if the peer is gone but 'in_fd' is not
+                shutdown(in_fd, SHUT_RD);
+                return;
+            }
+        }
+    });
+
+    // false once responses can't be written any more
+    auto enqueue = [&](std::future<std::string> response) {
+        {
+            std::lock_guard<std::mutex> lock(mutex);
+
+            if (closed) {
+                return false;
+            }
+
+            pending.push(std::move(response));
+        }
+        ready.notify_one();
+        return true;
+    };
+
+    FdReader reader(in_fd);
+    std::string header;
+
+    // longer than any valid header, and not a request
+    while (reader.read_line(header, 64)) {
+        auto received = std::chrono::steady_clock::now();
+        std::istringstream fields(header);
+        std::string command;
+        size_t length = 0;
+        fields >> command;
+
+        // made when the writer gets to it, so the requests before it
+        // have finished and are counted
+        if (command == "stats") {
+            if (!enqueue(std::async(std::launch::deferred, [this] {
+                    return response("ok", stats.report());
+                }))) {
+                break;
+            }
+            continue;
+        }
+
+        std::string source;
+
+        if (command != "eval" || !(fields >> length) ||
+            length > max_request || !reader.read_bytes(source, length)) {
+            std::promise<std::string> error;
+            error.set_value(response("error", "malformed request"));
+            enqueue(error.get_future());
+            break;
+        }
+
+        auto task = std::make_shared<std::packaged_task<std::string()>>(
+                [this, source = std::move(source), received] {
+                    return evaluate(source, received);
+                });
+        if (!enqueue(task->get_future())) {
+            break;
+        }
+
+        pool.submit([task] { (*task)(); });
+    }
+
+    {
+        std::lock_guard<std::mutex> lock(mutex);
+        finished = true;
+    }
+
+    ready.notify_one();
+    writer.join();
+}
+
+void Server::serve_socket(const std::string &path) {
+    sockaddr_un address{};
+    address.sun_family = AF_UNIX;
+
+    if (path.size() >= sizeof address.sun_path) {
+        throw std::system_error(ENAMETOOLONG, std::generic_category(), path);
+    }
+
+    path.copy(address.sun_path, path.size());
+    // a client that leaves before its response must not end the server,
+    // writing to it fails with EPIPE instead
+    signal(SIGPIPE, SIG_IGN);
+
+    int listener = socket(AF_UNIX, SOCK_STREAM, 0);
+
+    if (listener < 0) {
+        throw std::system_error(errno, std::generic_category(), "socket");
+    }
+
+    unlink(path.c_str());
+
+    if (bind(listener, reinterpret_cast<sockaddr*>(&address),
+             sizeof address) < 0 || listen(listener, SOMAXCONN) < 0) {
+        int error = errno;
+        close(listener);
+        throw std::system_error(error, std::generic_category(), path);
+    }
+
+    while (true) {
+        int connection = accept(listener, nullptr, nullptr);
+
+        if (connection < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+
+            int error = errno;
+            close(listener);
+            throw std::system_error(error, std::generic_category(), "accept");
+        }
+
+        std::thread([this, connection] {
+            serve_connection(connection, connection);
+            close(connection);
+        }).detach();
+    }
+}
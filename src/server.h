@@ -0,0 +1,140 @@
+#ifndef __SERVER_H__
+#define __SERVER_H__
+
+#include <chrono>
+#include <condition_variable>
+#include <cstdint>
+#include <functional>
+#include <list>
+#include <memory>
+#include <mutex>
+#include <queue>
+#include <string>
+#include <thread>
+#include <unordered_map>
+#include <vector>
+#include "interpreter.h"
+
+/**
+ * Fixed set of worker threads running submitted tasks in FIFO order.
+ */
+class ThreadPool {
+    std::vector<std::thread> workers;
+    std::queue<std::function<void()>> tasks;
+    std::mutex mutex;
+    std::condition_variable ready;
+    bool stopping;
+
+    void work();
+
+public:
+
+    explicit ThreadPool(size_t threads);
+
+    ~ThreadPool();
+
+    void submit(std::function<void()> task);
+};
+
+/**
+ * LRU cache of prepared programs keyed by a hash of their source text.
+ * The source is kept alongside, so a hash collision is a miss rather
+ * than a wrong program.
+ */
+class ProgramCache {
+    struct Entry {
+        uint64_t hash;
+        std::string source;
+        ProgramHandle program;
+    };
+
+    size_t capacity;
+    // most recently used first
+    std::list<Entry> entries;
+    std::unordered_map<uint64_t, std::list<Entry>::iterator> index;
+    std::mutex mutex;
+
+public:
+
+    explicit ProgramCache(size_t capacity);
+
+    static uint64_t hash(const std::string &source);
+
+    /**
+     * @return the cached program, or nullptr on a miss
+     */
+    ProgramHandle find(uint64_t hash, const std::string &source);
+
+    void insert(uint64_t hash, const std::string &source,
+                ProgramHandle program);
+};
+
+/**
+ * Request counters and a sliding window of latencies for percentiles.
+ */
+class ServerStats {
+    static constexpr size_t window = 1 << 16;
+
+    std::vector<double> latencies;
+    size_t next_sample;
+    uint64_t requests;
+    uint64_t errors;
+    uint64_t cache_hits;
+    uint64_t cache_misses;
+    std::chrono::steady_clock::time_point start;
+    std::mutex mutex;
+
+public:
+
+    ServerStats();
+
+    void record(double seconds, bool cache_hit, bool error);
+
+    /**
+     * @return "name value" lines: requests, errors, throughput_rps,
+     *         cache_hit_rate, latency_p50_us and latency_p99_us
+     */
+    std::string report();
+};
+
+/**
+ * Evaluates DL programs sent over a framed byte stream.
+ *
+ * Requests are "eval <n>\n" followed by n bytes of program text, or
+ * "stats\n". Every request gets a "<ok|error> <n>\n" header, n bytes of
+ * payload and a newline, in the order the requests arrived; a stats
+ * report covers every request before it. Programs of one connection
+ * are evaluated concurrently on the pool, each by its own Interpreter.
+ * A request over max_request bytes is malformed.
+ */
+class Server {
+    ThreadPool pool;
+    ProgramCache cache;
+    ServerStats stats;
+
+    std::string evaluate(const std::string &source,
+                         std::chrono::steady_clock::time_point received);
+
+public:
+
+    static constexpr size_t max_request = 64 << 20;
+
+    Server(size_t threads, size_t cache_size);
+
+    /**
+     * Serves requests read from 'in_fd' until end of input, a malformed
+     * request or a failed write of a response to 'out_fd'.
+     */
+    void serve_connection(int in_fd, int out_fd);
+
+    /**
+     * Listens on a Unix domain socket at 'path' and serves every accepted
+     * connection on its own thread. Does not return unless the socket
+     * can't be set up.
+     *
+     * @throws std::system_error if the socket can't be created
+     */
+    void serve_socket(const std::string &path);
+};
+
+#endif // __SERVER_H__
@@ -0,0 +1,98 @@
+#include "specialize.h"
+
+template <class L, class R>
+static std::shared_ptr<Expression> fuse_add(Expression &node) {
+    if (node.getType() != add || !L::accepts(*node.child(0)) ||
+        !R::accepts(*node.child(1))) {
+        return nullptr;
+    }
+
+    return make_counted<FusedAdd<L, R>, ast_nodes>(L(node.child(0)),
+                                                   R(node.child(1)));
+}
+
+template <class L, class R>
+static std::shared_ptr<Expression> fuse_if(Expression &node) {
+    if (node.getType() != _if || !L::accepts(*node.child(0)) ||
+        !R::accepts(*node.child(1))) {
+        return nullptr;
+    }
+
+    return make_counted<FusedIf<L, R>, ast_nodes>(L(node.child(0)),
+            R(node.child(1)), ExprOperand(node.child(2)),
+            ExprOperand(node.child(3)));
+}
+
+template <class A>
+static std::shared_ptr<Expression> fuse_call(Expression &node) {
+    if (node.getType() != call || !VarOperand::accepts(*node.child(0)) ||
+        !A::accepts(*node.child(1))) {
+        return nullptr;
+    }
+
+    return make_counted<FusedCall<A>, ast_nodes>(VarOperand(node.child(0)),
+                                                 A(node.child(1)));
+}
+
+template <class L, class R>
+static void add_binary_patterns(std::vector<SpecializationPattern> &patterns) {
+    std::string operands = std::string(L::name) + " " + R::name;
+    patterns.push_back({"add " + operands, &fuse_add<L, R>});
+    patterns.push_back({"if " + operands, &fuse_if<L, R>});
+}
+
+static std::vector<SpecializationPattern> make_default_patterns() {
+    std::vector<SpecializationPattern> patterns;
+
+    add_binary_patterns<VarOperand, ValOperand>(patterns);
+    add_binary_patterns<ValOperand, VarOperand>(patterns);
+    add_binary_patterns<VarOperand, VarOperand>(patterns);
+    add_binary_patterns<ValOperand, ValOperand>(patterns);
+    add_binary_patterns<VarOperand, ExprOperand>(patterns);
+    add_binary_patterns<ExprOperand, VarOperand>(patterns);
+    add_binary_patterns<ValOperand, ExprOperand>(patterns);
+    add_binary_patterns<ExprOperand, ValOperand>(patterns);
+
+    patterns.push_back({"call var val", &fuse_call<ValOperand>});
+    patterns.push_back({"call var var", &fuse_call<VarOperand>});
+    patterns.push_back({"call var expr", &fuse_call<ExprOperand>});
+    return patterns;
+}
+
+const std::vector<SpecializationPattern>& default_patterns() {
+    static const std::vector<SpecializationPattern> patterns =
+            make_default_patterns();
+    return patterns;
+}
+
+std::vector<size_t> specialize(std::shared_ptr<Expression> &program,
+        const std::vector<SpecializationPattern> &patterns) {
+    std::vector<size_t> hits(patterns.size(), 0);
+    // slots live in nodes that stay untouched until the slot is visited
+    std::vector<std::shared_ptr<Expression>*> pending = {&program};
+
+    while (!pending.empty()) {
+        std::shared_ptr<Expression> &slot = *pending.back();
+        pending.pop_back();
+
+        if (slot == nullptr) {
+            continue;
+        }
+
+        for (size_t i = 0; i < patterns.size(); i++) {
+            std::shared_ptr<Expression> fused = patterns[i].rewrite(*slot);
+
+            if (fused != nullptr) {
+                slot = std::move(fused);
+                hits[i]++;
+                break;
+            }
+        }
+
+        for (size_t i = slot->child_count(); i > 0; i--) {
+            pending.push_back(&slot->child(i - 1));
+        }
+    }
+
+    return hits;
+}
@@ -0,0 +1,390 @@
+#ifndef __SPECIALIZE_H__
+#define __SPECIALIZE_H__
+
+#include <functional>
+#include <memory>
+#include <string>
+#include <vector>
+#include "expressions.h"
+#include "errors.h"
+
+/*
+ * Operand kinds of the fused expressions. Each reads its operand
+ * directly, without a virtual eval() or a temporary Val for constants
+ * and variables; ExprOperand is the general case.
+ */
+
+struct ValOperand {
+    static constexpr const char *name = "val";
+    static constexpr size_t children = 0;
+
+    std::shared_ptr<Expression> node;
+    int integer;
+
+    explicit ValOperand(std::shared_ptr<Expression> node) :
+        node(std::move(node)),
+        integer(this->node->get_value())
+    {}
+
+    static bool accepts(Expression &expr) {
+        return expr.getType() == val;
+    }
+
+    int get_value(Env &) const {
+        return integer;
+    }
+
+    // values are never modified, the literal itself can be passed on
+    std::shared_ptr<Expression> value(Env &) const {
+        return node;
+    }
+
+    std::shared_ptr<Expression>* slot() {
+        return nullptr;
+    }
+
+    void note_free_vars(FreeVars &) const {}
+
+    void note_slots(const SlotScope &) {}
+
+    std::string to_string() const {
+        return node->to_string();
+    }
+};
+
+struct VarOperand {
+    static constexpr const char *name = "var";
+    static constexpr size_t children = 0;
+
+    std::string id;
+    int var_slot;
+
+    explicit VarOperand(const std::shared_ptr<Expression> &node) :
+        id(node->get_id()),
+        var_slot(VarRef::by_name)
+    {}
+
+    static bool accepts(Expression &expr) {
+        return expr.getType() == var;
+    }
+
+    int get_value(Env &env) const {
+        return env.lookup(id, var_slot)->get_value();
+    }
+
+    std::shared_ptr<Expression> value(Env &env) const {
+        return env.fromEnv(id, var_slot);
+    }
+
+    std::shared_ptr<Expression>* slot() {
+        return nullptr;
+    }
+
+    void note_free_vars(FreeVars &free) const {
+        free.names.insert(id);
+    }
+
+    void note_slots(const SlotScope &scope) {
+        var_slot = slot_of(scope, id);
+    }
+
+    std::string to_string() const {
+        return "(var " + id + ")";
+    }
+};
+
+struct ExprOperand {
+    static constexpr const char *name = "expr";
+    static constexpr size_t children = 1;
+
+    std::shared_ptr<Expression> expr;
+
+    explicit ExprOperand(std::shared_ptr<Expression> node) :
+        expr(std::move(node))
+    {}
+
+    static bool accepts(Expression &expr) {
+        return !ValOperand::accepts(expr) && !VarOperand::accepts(expr);
+    }
+
+    int get_value(Env &env) const {
+        return expr->eval(env)->get_value();
+    }
+
+    std::shared_ptr<Expression> value(Env &env) const {
+        return expr->eval(env);
+    }
+
+    std::shared_ptr<Expression>* slot() {
+        return &expr;
+    }
+
+    void note_free_vars(FreeVars &) const {}
+
+    void note_slots(const SlotScope &) {}
+
+    std::string to_string() const {
+        return expr->to_string();
+    }
+};
+
+/**
+ * Child number 'index' among the general operands, in order.
+ */
+template <class... Operands>
+std::shared_ptr<Expression>& operand_child(size_t index,
+                                           Operands&... operands) {
+    std::shared_ptr<Expression> *slots[] = {operands.slot()...};
+
+    for (auto *slot : slots) {
+        if (slot != nullptr && index-- == 0) {
+            return *slot;
+        }
+    }
+
+    throw eval_error();
+}
+
+/**
+ * (add L R) with both operands read in place.
+ */
+template <class L, class R>
+class FusedAdd : public Expression {
+    L left;
+    R right;
+public:
+
+    FusedAdd(L left, R right) :
+        Expression(add),
+        left(std::move(left)),
+        right(std::move(right))
+    {}
+
+    ~FusedAdd() override {
+        release_subtree();
+    }
+
+    std::shared_ptr<Expression> eval(Env &env) override {
+        env.check_depth();
+        return make_counted<Val, runtime_values>(left.get_value(env) +
+                                                 right.get_value(env));
+    }
+
+    int get_value() const override {
+        throw getValue_error();
+    }
+
+    std::string get_id() const override {
+        throw parse_error();
+    }
+
+    std::string to_string() const override {
+        return "(add " + left.to_string() + " " + right.to_string() + ")";
+    }
+
+    size_t child_count() const override {
+        return L::children + R::children;
+    }
+
+    bool is_fused() const override {
+        return true;
+    }
+
+    std::shared_ptr<Expression>& child(size_t index) override {
+        return operand_child(index, left, right);
+    }
+
+    void note_free_vars(FreeVars &free) override {
+        left.note_free_vars(free);
+        right.note_free_vars(free);
+    }
+
+    void note_slots(const SlotScope &scope) override {
+        left.note_slots(scope);
+        right.note_slots(scope);
+    }
+};
+
+/**
+ * (if L R then ... else ...) with the compared operands read in place.
+ */
+template <class L, class R>
+class FusedIf : public Expression {
+    L if_left_;
+    R if_right_;
+    ExprOperand then_;
+    ExprOperand else_;
+public:
+
+    FusedIf(L if_left_, R if_right_, ExprOperand then_, ExprOperand else_) :
+        Expression(_if),
+        if_left_(std::move(if_left_)),
+        if_right_(std::move(if_right_)),
+        then_(std::move(then_)),
+        else_(std::move(else_))
+    {}
+
+    ~FusedIf() override {
+        release_subtree();
+    }
+
+    std::shared_ptr<Expression> eval(Env &env) override {
+        env.check_depth();
+        if (if_left_.get_value(env) > if_right_.get_value(env)) {
+            return then_.expr->eval(env);
+        }
+
+        return else_.expr->eval(env);
+    }
+
+    int get_value() const override {
+        throw getValue_error();
+    }
+
+    std::string get_id() const override {
+        throw parse_error();
+    }
+
+    std::string to_string() const override {
+        return "(if " + if_left_.to_string() + " " +
+                if_right_.to_string() + "\nthen " +
+                then_.to_string() + "\nelse" + else_.to_string() + ")";
+    }
+
+    size_t child_count() const override {
+        return L::children + R::children + 2;
+    }
+
+    bool is_fused() const override {
+        return true;
+    }
+
+    std::shared_ptr<Expression>& child(size_t index) override {
+        return operand_child(index, if_left_, if_right_, then_, else_);
+    }
+
+    void note_free_vars(FreeVars &free) override {
+        if_left_.note_free_vars(free);
+        if_right_.note_free_vars(free);
+    }
+
+    void note_slots(const SlotScope &scope) override {
+        if_left_.note_slots(scope);
+        if_right_.note_slots(scope);
+    }
+};
+
+/**
+ * (call (var f) A): the callee is looked up directly.
+ */
+template <class A>
+class FusedCall : public Expression {
+    VarOperand callee;
+    A argument;
+    // as in Call, set while resolving captures
+    bool arg_deferred;
+    std::vector<VarRef> arg_free_vars;
+public:
+
+    FusedCall(VarOperand callee, A argument) :
+        Expression(call),
+        callee(std::move(callee)),
+        argument(std::move(argument)),
+        arg_deferred(false)
+    {}
+
+    ~FusedCall() override {
+        release_subtree();
+    }
+
+    std::shared_ptr<Expression> eval(Env &env) override {
+        env.check_depth();
+        std::shared_ptr<Expression> func = callee.value(env);
+
+        if constexpr (A::children != 0) {
+            if (env.lazy && arg_deferred) {
+                return Call::invoke(env, func,
+                        env.delay(argument.expr, arg_free_vars));
+            }
+        }
+
+        return Call::invoke(env, func, argument.value(env));
+    }
+
+    int get_value() const override {
+        throw getValue_error();
+    }
+
+    std::string get_id() const override {
+        throw parse_error();
+    }
+
+    std::string to_string() const override {
+        return "(call " + callee.to_string() + " " +
+                argument.to_string() + ")";
+    }
+
+    size_t child_count() const override {
+        return A::children;
+    }
+
+    bool is_fused() const override {
+        return true;
+    }
+
+    std::shared_ptr<Expression>& child(size_t index) override {
+        return operand_child(index, argument);
+    }
+
+    void bind_free_vars(size_t, FreeVars &free) override {
+        if constexpr (A::children != 0) {
+            arg_deferred = deferrable(*argument.expr, free);
+            arg_free_vars.clear();
+
+            for (const auto& name : free.names) {
+                arg_free_vars.push_back({name});
+            }
+        }
+    }
+
+    void note_free_vars(FreeVars &free) override {
+        callee.note_free_vars(free);
+        argument.note_free_vars(free);
+        free.effects = true;
+    }
+
+    void note_slots(const SlotScope &scope) override {
+        callee.note_slots(scope);
+        argument.note_slots(scope);
+
+        for (auto& ref : arg_free_vars) {
+            ref.slot = slot_of(scope, ref.id);
+        }
+    }
+};
+
+/**
+ * Rewrite rule of specialize(). 'rewrite' returns the replacement of
+ * a node, or nullptr if the pattern doesn't apply to it.
+ */
+struct SpecializationPattern {
+    std::string name;
+    std::function<std::shared_ptr<Expression>(Expression&)> rewrite;
+};
+
+/**
+ * The fused add, if and call patterns for every combination of operand
+ * kinds except the fully general one. Built once and shared.
+ */
+const std::vector<SpecializationPattern>& default_patterns();
+
+/**
+ * Replaces each node of 'program' by the rewrite of the first pattern
+ * that applies to it. Runs before resolve_captures().
+ *
+ * @return how many nodes each pattern rewrote, by pattern index
+ */
+std::vector<size_t> specialize(std::shared_ptr<Expression> &program,
+        const std::vector<SpecializationPattern> &patterns);
+
+#endif // __SPECIALIZE_H__